@@ -0,0 +1,410 @@
+#include <string.h> // memcpy()
+
+#include "b64.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSSE3/AVX2/AVX-512 intrinsics
+#define HAVE_X86_KERNELS 1
+#endif
+
+/* Maps a character to its 6-bit value, or -1 if it is not in the alphabet. */
+static int8_t const std_values[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static int8_t const url_values[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/* Characters encoded per kernel call when wrapping needs a staging copy */
+#define SCRATCH_CHARS 4096
+
+/* Kernel tiers, from slowest to fastest; see b64_cpu_level(). */
+enum { LEVEL_SCALAR, LEVEL_SSSE3, LEVEL_AVX2, LEVEL_AVX512VBMI, NLEVELS = B64_NLEVELS };
+
+/* Everything that depends on the alphabet. Each instance of b64_kernels.h
+ * fills one in with kernels that have the alphabet compiled into them. */
+struct alphabet {
+	char const *chars;
+	int8_t const *values;
+	b64_encode_kernel encode[NLEVELS];
+	b64_decode_kernel decode[NLEVELS];
+};
+
+#define KERNEL(name) name##_std
+#define ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+#define CHAR_62 '+'
+#define CHAR_63 '/'
+#define VALUES std_values
+#define DEC_LUT_LO 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+	0x11, 0x11, 0x13, 0x3A, 0x3B, 0x3B, 0x3B, 0x3A
+#define DEC_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define DEC_SPECIAL '/'
+#define DEC_BUMP -1
+#include "b64_kernels.h"
+
+#define KERNEL(name) name##_url
+#define ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+#define CHAR_62 '-'
+#define CHAR_63 '_'
+#define VALUES url_values
+#define DEC_LUT_LO 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+	0x11, 0x11, 0x13, 0x3B, 0x3B, 0x3A, 0x3B, 0x33
+#define DEC_ROLL 0, 0, 17, 4, -65, -65, -71, -71, -32, 0, 0, 0, 0, 0, 0, 0
+#define DEC_SPECIAL '_'
+#define DEC_BUMP 3
+#include "b64_kernels.h"
+
+static struct alphabet const *
+get_alphabet(int alphabet)
+{
+	return alphabet == B64_URLSAFE ? &alphabet_url : &alphabet_std;
+}
+
+extern int
+b64_cpu_level(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw")) {
+		return LEVEL_AVX512VBMI;
+	}
+	if (__builtin_cpu_supports("avx2")) return LEVEL_AVX2;
+	if (__builtin_cpu_supports("ssse3")) return LEVEL_SSSE3;
+#endif
+	return LEVEL_SCALAR;
+}
+
+extern char const *
+b64_level_name(int level)
+{
+	static char const *const names[NLEVELS] = { "scalar", "ssse3", "avx2", "avx512vbmi" };
+	return level >= 0 && level < NLEVELS ? names[level] : "unknown";
+}
+
+extern b64_encode_kernel
+b64_encode_kernel_at(int alphabet, int level)
+{
+	return get_alphabet(alphabet)->encode[level];
+}
+
+extern b64_decode_kernel
+b64_decode_kernel_at(int alphabet, int level)
+{
+	return get_alphabet(alphabet)->decode[level];
+}
+
+/* Copies already-encoded characters to `out`, breaking lines as it goes. */
+static char *
+put_wrapped(struct b64_encoder *enc, char const *src, size_t n, char *out)
+{
+	size_t wrap = enc->opts.wrap;
+	if (wrap == 0) {
+		memcpy(out, src, n);
+		return out + n;
+	}
+	while (n > 0) {
+		size_t room = wrap - enc->column;
+		size_t k = n < room ? n : room;
+		memcpy(out, src, k);
+		out += k;
+		src += k;
+		n -= k;
+		enc->column += k;
+		if (enc->column == wrap) {
+			*out++ = '\n';
+			enc->column = 0;
+		}
+	}
+	return out;
+}
+
+/* The encode_groups strategies. Each encodes `len` bytes (a multiple of 3) and
+ * is picked once by b64_encoder_init(), so the choice between them is never
+ * made inside the loop. */
+
+/* No line breaks: one kernel call over the whole span. */
+static char *
+encode_groups_unwrapped(struct b64_encoder *enc, uint8_t const *in, size_t len, char *out)
+{
+	return out + enc->kernel(in, len, out) / 3 * 4;
+}
+
+/* Lines hold a whole number of groups, so the kernel writes each line in
+ * place and only the newline is added between calls. */
+static char *
+encode_groups_aligned(struct b64_encoder *enc, uint8_t const *in, size_t len, char *out)
+{
+	size_t wrap = enc->opts.wrap;
+	while (len > 0) {
+		size_t room = (wrap - enc->column) / 4 * 3;
+		size_t n = len < room ? len : room;
+		enc->kernel(in, n, out);
+		out += n / 3 * 4;
+		enc->column += n / 3 * 4;
+		if (enc->column == wrap) {
+			*out++ = '\n';
+			enc->column = 0;
+		}
+		in += n;
+		len -= n;
+	}
+	return out;
+}
+
+/* Any other width: encode into a stack buffer and break lines while copying. */
+static char *
+encode_groups_staged(struct b64_encoder *enc, uint8_t const *in, size_t len, char *out)
+{
+	char scratch[SCRATCH_CHARS];
+	while (len > 0) {
+		size_t n = len < SCRATCH_CHARS / 4 * 3 ? len : SCRATCH_CHARS / 4 * 3;
+		enc->kernel(in, n, scratch);
+		out = put_wrapped(enc, scratch, n / 3 * 4, out);
+		in += n;
+		len -= n;
+	}
+	return out;
+}
+
+extern void
+b64_encoder_init(struct b64_encoder *enc, struct b64_options opts)
+{
+	struct alphabet const *alpha = get_alphabet(opts.alphabet);
+	enc->kernel = alpha->encode[b64_cpu_level()];
+	enc->alphabet = alpha->chars;
+	if (opts.wrap == 0) {
+		enc->encode_groups = encode_groups_unwrapped;
+	} else if (opts.wrap % 4 == 0) {
+		enc->encode_groups = encode_groups_aligned;
+	} else {
+		enc->encode_groups = encode_groups_staged;
+	}
+	enc->opts = opts;
+	enc->column = 0;
+	enc->ncarry = 0;
+}
+
+/* Exact number of characters b64_encode_update(enc, ..., len, ...) writes. */
+extern size_t
+b64_encode_bound(struct b64_encoder const *enc, size_t len)
+{
+	size_t chars = (enc->ncarry + len) / 3 * 4;
+	return chars + (enc->opts.wrap ? (enc->column + chars) / enc->opts.wrap : 0);
+}
+
+/* Encodes the first enc->ncarry bytes of the carry as one group. Padding is
+ * only ever needed here, so it costs nothing in the kernels. Returns the
+ * number of characters to emit. */
+static size_t
+encode_carry(struct b64_encoder const *enc, char group[4])
+{
+	char const *alphabet = enc->alphabet;
+	uint8_t const *c = enc->carry;
+	uint8_t c1 = enc->ncarry > 1 ? c[1] : 0;
+	uint8_t c2 = enc->ncarry > 2 ? c[2] : 0;
+	group[0] = alphabet[c[0] >> 2];
+	group[1] = alphabet[(c[0] << 4 | c1 >> 4) & 0x3Fu];
+	group[2] = enc->ncarry > 1 ? alphabet[(c1 << 2 | c2 >> 6) & 0x3Fu] : '=';
+	group[3] = enc->ncarry > 2 ? alphabet[c2 & 0x3Fu] : '=';
+	return enc->ncarry == 3 || enc->opts.pad ? 4 : enc->ncarry + 1;
+}
+
+extern size_t
+b64_encode_update(struct b64_encoder *enc, void const *data, size_t len, char *out)
+{
+	uint8_t const *in = data;
+	char *start = out;
+
+	/* Complete the group left over from the previous call first. */
+	if (enc->ncarry > 0) {
+		while (enc->ncarry < 3 && len > 0) {
+			enc->carry[enc->ncarry++] = *in++;
+			len--;
+		}
+		if (enc->ncarry < 3) return 0;
+		char group[4];
+		out = put_wrapped(enc, group, encode_carry(enc, group), out);
+		enc->ncarry = 0;
+	}
+
+	size_t whole = len / 3 * 3;
+	out = enc->encode_groups(enc, in, whole, out);
+	for (size_t i = whole; i < len; i++) {
+		enc->carry[enc->ncarry++] = in[i];
+	}
+	return out - start;
+}
+
+/* Flushes the last partial group and ends the current line. */
+extern size_t
+b64_encode_final(struct b64_encoder *enc, char *out)
+{
+	char *start = out;
+	if (enc->ncarry > 0) {
+		char group[4];
+		out = put_wrapped(enc, group, encode_carry(enc, group), out);
+		enc->ncarry = 0;
+	}
+	if (enc->opts.wrap && enc->column > 0) {
+		*out++ = '\n';
+		enc->column = 0;
+	}
+	return out - start;
+}
+
+extern size_t
+b64_encoded_size(size_t len, struct b64_options opts)
+{
+	size_t chars = len / 3 * 4;
+	if (len % 3) chars += opts.pad ? 4 : len % 3 + 1;
+	return chars + (opts.wrap ? (chars + opts.wrap - 1) / opts.wrap : 0);
+}
+
+extern size_t
+b64_encode(void const *in, size_t len, char *out, struct b64_options opts)
+{
+	struct b64_encoder enc;
+	b64_encoder_init(&enc, opts);
+	size_t n = b64_encode_update(&enc, in, len, out);
+	return n + b64_encode_final(&enc, out + n);
+}
+
+extern void
+b64_decoder_init(struct b64_decoder *dec, int alphabet)
+{
+	struct alphabet const *alpha = get_alphabet(alphabet);
+	memset(dec, 0, sizeof *dec);
+	dec->kernel = alpha->decode[b64_cpu_level()];
+	dec->values = alpha->values;
+}
+
+/* Upper bound on the bytes one b64_decode_update() call of `len` characters
+ * writes, including a group completed from the previous call's carry. */
+extern size_t
+b64_decode_bound(size_t len)
+{
+	return (len / 4 + 1) * 3;
+}
+
+static int
+decode_fail(struct b64_decoder *dec, int error, int c)
+{
+	dec->error = error;
+	dec->bad_char = c;
+	return -1;
+}
+
+/* Feeds one character that the kernel refused to the state machine. Returns
+ * the number of bytes written to `out`, or -1. */
+static int
+decode_slow(struct b64_decoder *dec, unsigned char c, uint8_t *out)
+{
+	if (c == '\n' || c == '\r') {
+		dec->offset++;
+		return 0;
+	}
+	if (dec->done) return decode_fail(dec, B64_ETRAILING, c);
+	if (c == '=') {
+		if (dec->n < 2) return decode_fail(dec, B64_EPAD, c);
+		dec->pad++;
+		dec->group[dec->n++] = 0;
+	} else {
+		if (dec->values[c] < 0 || dec->pad) return decode_fail(dec, B64_EINVAL, c);
+		dec->group[dec->n++] = dec->values[c];
+	}
+	dec->offset++;
+	if (dec->n < 4) return 0;
+
+	uint32_t v = (uint32_t)dec->group[0] << 18 | (uint32_t)dec->group[1] << 12 |
+	  (uint32_t)dec->group[2] << 6 | dec->group[3];
+	out[0] = v >> 16;
+	out[1] = v >> 8;
+	out[2] = v;
+	dec->n = 0;
+	dec->done = dec->pad > 0;
+	return 3 - dec->pad;
+}
+
+extern int
+b64_decode_update(struct b64_decoder *dec, char const *in, size_t len, uint8_t *out,
+		  size_t *out_len)
+{
+	char const *p = in, *end = in + len;
+	uint8_t *start = out;
+	while (p < end) {
+		if (dec->n == 0 && !dec->done) {
+			size_t done = dec->kernel(p, end - p, out);
+			out += done / 4 * 3;
+			dec->offset += done;
+			p += done;
+			if (p == end) break;
+		}
+		int n = decode_slow(dec, *p++, out);
+		if (n < 0) return -1;
+		out += n;
+	}
+	*out_len = out - start;
+	return 0;
+}
+
+/* Flushes an unpadded final group; at most 2 bytes. */
+extern int
+b64_decode_final(struct b64_decoder *dec, uint8_t *out, size_t *out_len)
+{
+	*out_len = 0;
+	/* Unpadded input is accepted as long as it does not end mid-byte. */
+	if (dec->n == 1 || (dec->n > 0 && dec->pad)) {
+		return decode_fail(dec, B64_ETRUNCATED, -1);
+	}
+	if (dec->n > 1) {
+		out[0] = dec->group[0] << 2 | dec->group[1] >> 4;
+		if (dec->n > 2) out[1] = dec->group[1] << 4 | dec->group[2] >> 2;
+		*out_len = dec->n - 1;
+		dec->n = 0;
+	}
+	return 0;
+}
+
+extern char const *
+b64_strerror(int error)
+{
+	switch (error) {
+	case B64_OK: return "Success";
+	case B64_EINVAL: return "Invalid character";
+	case B64_EPAD: return "Unexpected padding";
+	case B64_ETRAILING: return "Invalid character after padding";
+	case B64_ETRUNCATED: return "Truncated input";
+	}
+	return "Unknown error";
+}
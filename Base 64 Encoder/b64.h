@@ -0,0 +1,104 @@
+#ifndef B64_H
+#define B64_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+
+/* Streaming base64 (RFC 4648) encoder and decoder.
+ *
+ * Neither direction allocates: every call writes into a caller-provided buffer
+ * whose required size is available up front from the *_bound() and
+ * b64_encoded_size() functions. The fastest kernel the running CPU supports is
+ * chosen when a state is initialized.
+ */
+
+/* Line length of MIME (RFC 2045) output, and of the base64 CLI */
+#define B64_MIME_WRAP 76
+
+/* Largest number of characters b64_encode_final() can produce */
+#define B64_ENCODE_FINAL_MAX 8
+
+/* Kernels convert as many whole groups as they can and return how much input
+ * they consumed. See b64.c for the exact contract. */
+typedef size_t (*b64_encode_kernel)(uint8_t const *in, size_t len, char *out);
+typedef size_t (*b64_decode_kernel)(char const *in, size_t len, uint8_t *out);
+
+enum b64_alphabet {
+	B64_STANDARD,     /* RFC 4648 section 4: '+' and '/' */
+	B64_URLSAFE,      /* RFC 4648 section 5: '-' and '_' */
+};
+
+struct b64_options {
+	int alphabet;     /* enum b64_alphabet */
+	size_t wrap;      /* Characters per line, or 0 for a single unbroken line */
+	int pad;          /* Nonzero to finish with '=' padding */
+};
+
+/* What the base64 CLI produces by default */
+#define B64_MIME_OPTIONS ((struct b64_options){ B64_STANDARD, B64_MIME_WRAP, 1 })
+
+struct b64_encoder {
+	/* Chosen once by b64_encoder_init() from the options and the CPU */
+	b64_encode_kernel kernel;
+	char *(*encode_groups)(struct b64_encoder *enc, uint8_t const *in, size_t len, char *out);
+	char const *alphabet;
+	struct b64_options opts;
+
+	size_t column;    /* Characters already on the current line */
+	int ncarry;       /* Input bytes held back until a whole group arrives */
+	uint8_t carry[3];
+};
+
+/* Error codes left in b64_decoder.error */
+enum b64_error {
+	B64_OK = 0,
+	B64_EINVAL,       /* Character outside the alphabet */
+	B64_EPAD,         /* '=' where padding cannot start */
+	B64_ETRAILING,    /* Data after the padded final group */
+	B64_ETRUNCATED,   /* Input ended in the middle of a byte */
+};
+
+struct b64_decoder {
+	b64_decode_kernel kernel;
+	int8_t const *values;
+	long long offset; /* Offset of the next character, or of the bad one */
+	int error;        /* enum b64_error, set when a call returns -1 */
+	int bad_char;     /* The offending character for B64_EINVAL/B64_ETRAILING */
+	int n;            /* Characters in the partial group */
+	int pad;          /* How many of them were '=' */
+	int done;         /* A padded group ended the data */
+	uint8_t group[4];
+};
+
+/* Encoding. When wrapping, every output line ends in '\n', including the last
+ * one. */
+extern void b64_encoder_init(struct b64_encoder *enc, struct b64_options opts);
+extern size_t b64_encode_bound(struct b64_encoder const *enc, size_t len);
+extern size_t b64_encode_update(struct b64_encoder *enc, void const *in, size_t len, char *out);
+extern size_t b64_encode_final(struct b64_encoder *enc, char *out);
+
+/* One-shot encoding; `out` must hold b64_encoded_size(len, opts) chars. */
+extern size_t b64_encoded_size(size_t len, struct b64_options opts);
+extern size_t b64_encode(void const *in, size_t len, char *out, struct b64_options opts);
+
+/* Decoding. '\n' and '\r' are skipped anywhere; unpadded input is accepted.
+ * Both calls return 0 and store the byte count in *out_len, or return -1 and
+ * leave the reason in dec->error and dec->offset. */
+extern void b64_decoder_init(struct b64_decoder *dec, int alphabet);
+extern size_t b64_decode_bound(size_t len);
+extern int b64_decode_update(struct b64_decoder *dec, char const *in, size_t len,
+			     uint8_t *out, size_t *out_len);
+extern int b64_decode_final(struct b64_decoder *dec, uint8_t *out, size_t *out_len);
+extern char const *b64_strerror(int error);
+
+/* Kernel tiers, for benchmarks and tests. Level 0 is the portable scalar code
+ * and higher levels are wider SIMD; b64_cpu_level() is the widest the running
+ * CPU supports and what the *_init() functions pick. Calling a kernel above
+ * b64_cpu_level() is undefined. */
+#define B64_NLEVELS 4
+extern int b64_cpu_level(void);
+extern char const *b64_level_name(int level);
+extern b64_encode_kernel b64_encode_kernel_at(int alphabet, int level);
+extern b64_decode_kernel b64_decode_kernel_at(int alphabet, int level);
+
+#endif
@@ -0,0 +1,257 @@
+/* Kernel template, included by b64.c once per alphabet so that every kernel
+ * has its alphabet baked in as constants. The includer defines:
+ *
+ *   KERNEL(name)   Appends the alphabet suffix to name
+ *   ALPHABET       The 64 characters, as a string literal
+ *   CHAR_62        Character for value 62
+ *   CHAR_63        Character for value 63
+ *   VALUES         Character to value table (-1 for invalid)
+ *   DEC_LUT_LO     Low-nibble validation masks (16 bytes, see decode_ssse3)
+ *   DEC_ROLL       Offsets back to 0..63, indexed by high nibble (16 bytes)
+ *   DEC_SPECIAL    The one character whose offset is not in its nibble's slot
+ *   DEC_BUMP       Added to DEC_SPECIAL's high nibble to find its slot
+ *
+ * and gets a `struct alphabet KERNEL(alphabet)` describing the result. Every
+ * macro above is #undef'd again at the end.
+ */
+
+/* An encode kernel converts as many whole 3-byte groups of `in` as it can into
+ * `out` and returns the number of input bytes consumed (a multiple of 3). It
+ * never reads past in[len - 1], never writes past the characters it produces
+ * and never writes padding. */
+
+/* Reference scalar encoder, also used for the tail of every SIMD kernel. */
+static size_t
+KERNEL(encode_scalar)(uint8_t const *in, size_t len, char *out)
+{
+	size_t i = 0;
+	for (; len - i >= 3; i += 3) {
+		out[0] = ALPHABET[in[i] >> 2];
+		out[1] = ALPHABET[(in[i] << 4 | in[i + 1] >> 4) & 0x3Fu];
+		out[2] = ALPHABET[(in[i + 1] << 2 | in[i + 2] >> 6) & 0x3Fu];
+		out[3] = ALPHABET[in[i + 2] & 0x3Fu];
+		out += 4;
+	}
+	return i;
+}
+
+/* A decode kernel converts as many whole 4-character groups of `in` as it can
+ * into `out` and returns the number of characters consumed (a multiple of 4).
+ * It stops at the first group holding anything but alphabet characters, so
+ * newlines, padding and invalid bytes are left for the caller. Vector stores
+ * may run past the decoded bytes but never past out[len / 4 * 3 - 1]. */
+
+/* Reference scalar decoder, also used for the tail of every SIMD kernel. */
+static size_t
+KERNEL(decode_scalar)(char const *in, size_t len, uint8_t *out)
+{
+	unsigned char const *s = (unsigned char const *)in;
+	size_t i = 0;
+	for (; len - i >= 4; i += 4) {
+		int a = VALUES[s[i]], b = VALUES[s[i + 1]];
+		int c = VALUES[s[i + 2]], d = VALUES[s[i + 3]];
+		if ((a | b | c | d) < 0) break;
+		uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6 | (uint32_t)d;
+		out[0] = v >> 16;
+		out[1] = v >> 8;
+		out[2] = v;
+		out += 3;
+	}
+	return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+/* SSSE3/AVX2 kernels follow Mula & Lemire, "Faster Base64 Encoding and
+ * Decoding using AVX2 Instructions": pshufb spreads 12 bytes over four 32-bit
+ * lanes, two multiplies extract the 6-bit indices, and a 16-entry offset
+ * table maps each index range onto its ASCII run. */
+#define ENC_SHIFT_LUT 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, CHAR_62 - 62, CHAR_63 - 63, 'A', 0, 0
+#define ENC_SHUF 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+#define DEC_LUT_HI 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x20, \
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define DEC_PACK 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static size_t
+KERNEL(encode_ssse3)(uint8_t const *in, size_t len, char *out)
+{
+	__m128i const shuf = _mm_setr_epi8(ENC_SHUF);
+	__m128i const shift_lut = _mm_setr_epi8(ENC_SHIFT_LUT);
+	size_t i = 0;
+	/* Each step loads 16 bytes but only consumes 12. */
+	for (; len - i >= 16; i += 12) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(in + i));
+		v = _mm_shuffle_epi8(v, shuf);
+		__m128i t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+		__m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+		__m128i t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+		__m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+		__m128i idx = _mm_or_si128(t1, t3);
+
+		__m128i res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+		res = _mm_or_si128(res, _mm_and_si128(less, _mm_set1_epi8(13)));
+		res = _mm_add_epi8(idx, _mm_shuffle_epi8(shift_lut, res));
+		_mm_storeu_si128((__m128i *)out, res);
+		out += 16;
+	}
+	return i + KERNEL(encode_scalar)(in + i, len - i, out);
+}
+
+__attribute__((target("avx2")))
+static size_t
+KERNEL(encode_avx2)(uint8_t const *in, size_t len, char *out)
+{
+	__m256i const shuf = _mm256_setr_epi8(ENC_SHUF, ENC_SHUF);
+	__m256i const shift_lut = _mm256_setr_epi8(ENC_SHIFT_LUT, ENC_SHIFT_LUT);
+	size_t i = 0;
+	/* Each 128-bit lane takes 12 bytes; the high lane loads from in + 12. */
+	for (; len - i >= 28; i += 24) {
+		__m256i v = _mm256_inserti128_si256(
+		  _mm256_castsi128_si256(_mm_loadu_si128((__m128i const *)(in + i))),
+		  _mm_loadu_si128((__m128i const *)(in + i + 12)), 1);
+		v = _mm256_shuffle_epi8(v, shuf);
+		__m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+		__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		__m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+		__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		__m256i idx = _mm256_or_si256(t1, t3);
+
+		__m256i res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		__m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+		res = _mm256_or_si256(res, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		res = _mm256_add_epi8(idx, _mm256_shuffle_epi8(shift_lut, res));
+		_mm256_storeu_si256((__m256i *)out, res);
+		out += 32;
+	}
+	return i + KERNEL(encode_ssse3)(in + i, len - i, out);
+}
+
+/* With VBMI the whole alphabet fits in one register: vpermb gathers the input
+ * triplets, vpmultishiftqb extracts every 6-bit index in place and a second
+ * vpermb performs the 64-entry table lookup. */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static size_t
+KERNEL(encode_avx512vbmi)(uint8_t const *in, size_t len, char *out)
+{
+	__m512i const shuf = _mm512_setr_epi32(
+	  0x01020001, 0x04050304, 0x07080607, 0x0a0b090a,
+	  0x0d0e0c0d, 0x10110f10, 0x13141213, 0x16171516,
+	  0x191a1819, 0x1c1d1b1c, 0x1f201e1f, 0x22232122,
+	  0x25262425, 0x28292728, 0x2b2c2a2b, 0x2e2f2d2e);
+	__m512i const shifts = _mm512_set1_epi64(0x3036242a1016040aLL);
+	__m512i const lut = _mm512_loadu_si512((void const *)ALPHABET);
+	size_t i = 0;
+	/* The masked load touches exactly the 48 bytes consumed. */
+	for (; len - i >= 48; i += 48) {
+		__m512i v = _mm512_maskz_loadu_epi8(0x0000ffffffffffffULL, in + i);
+		v = _mm512_permutexvar_epi8(shuf, v);
+		v = _mm512_multishift_epi64_epi8(shifts, v);
+		_mm512_storeu_si512((void *)out, _mm512_permutexvar_epi8(v, lut));
+		out += 64;
+	}
+	return i + KERNEL(encode_avx2)(in + i, len - i, out);
+}
+
+/* Validation and translation use the nibble lookups from the same paper: each
+ * character is valid iff the lookups on its low and high nibble share no bit,
+ * and the high nibble (moved by DEC_BUMP for DEC_SPECIAL) selects the offset
+ * back to 0..63. */
+__attribute__((target("ssse3")))
+static size_t
+KERNEL(decode_ssse3)(char const *in, size_t len, uint8_t *out)
+{
+	__m128i const lut_lo = _mm_setr_epi8(DEC_LUT_LO);
+	__m128i const lut_hi = _mm_setr_epi8(DEC_LUT_HI);
+	__m128i const lut_roll = _mm_setr_epi8(DEC_ROLL);
+	__m128i const pack = _mm_setr_epi8(DEC_PACK);
+	size_t i = 0;
+	/* Stop while the 16-byte store is still inside len / 4 * 3. */
+	for (; len - i >= 24; i += 16) {
+		__m128i str = _mm_loadu_si128((__m128i const *)(in + i));
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), _mm_set1_epi8(0x0f));
+		__m128i lo_nibbles = _mm_and_si128(str, _mm_set1_epi8(0x0f));
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff) {
+			break;
+		}
+		__m128i special = _mm_cmpeq_epi8(str, _mm_set1_epi8(DEC_SPECIAL));
+		special = _mm_and_si128(special, _mm_set1_epi8(DEC_BUMP));
+		__m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(special, hi_nibbles));
+		str = _mm_add_epi8(str, roll);
+
+		/* Merge four 6-bit values into 24 bits per lane, then drop byte 3. */
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(str, pack));
+		out += 12;
+	}
+	return i + KERNEL(decode_scalar)(in + i, len - i, out);
+}
+
+__attribute__((target("avx2")))
+static size_t
+KERNEL(decode_avx2)(char const *in, size_t len, uint8_t *out)
+{
+	__m256i const lut_lo = _mm256_setr_epi8(DEC_LUT_LO, DEC_LUT_LO);
+	__m256i const lut_hi = _mm256_setr_epi8(DEC_LUT_HI, DEC_LUT_HI);
+	__m256i const lut_roll = _mm256_setr_epi8(DEC_ROLL, DEC_ROLL);
+	__m256i const pack = _mm256_setr_epi8(DEC_PACK, DEC_PACK);
+	size_t i = 0;
+	/* Stop while the 32-byte store is still inside len / 4 * 3. */
+	for (; len - i >= 44; i += 32) {
+		__m256i str = _mm256_loadu_si256((__m256i const *)(in + i));
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), _mm256_set1_epi8(0x0f));
+		__m256i lo_nibbles = _mm256_and_si256(str, _mm256_set1_epi8(0x0f));
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi)) break;
+		__m256i special = _mm256_cmpeq_epi8(str, _mm256_set1_epi8(DEC_SPECIAL));
+		special = _mm256_and_si256(special, _mm256_set1_epi8(DEC_BUMP));
+		__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(special, hi_nibbles));
+		str = _mm256_add_epi8(str, roll);
+
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, pack);
+		/* Close the 4-byte gap between the two 12-byte lanes. */
+		str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm256_storeu_si256((__m256i *)out, str);
+		out += 24;
+	}
+	return i + KERNEL(decode_ssse3)(in + i, len - i, out);
+}
+
+#undef ENC_SHIFT_LUT
+#undef ENC_SHUF
+#undef DEC_LUT_HI
+#undef DEC_PACK
+#endif
+
+static struct alphabet const KERNEL(alphabet) = {
+	.chars = ALPHABET,
+	.values = VALUES,
+#ifdef HAVE_X86_KERNELS
+	.encode = { KERNEL(encode_scalar), KERNEL(encode_ssse3), KERNEL(encode_avx2),
+	  KERNEL(encode_avx512vbmi) },
+	.decode = { KERNEL(decode_scalar), KERNEL(decode_ssse3), KERNEL(decode_avx2),
+	  KERNEL(decode_avx2) },
+#else
+	.encode = { KERNEL(encode_scalar), KERNEL(encode_scalar), KERNEL(encode_scalar),
+	  KERNEL(encode_scalar) },
+	.decode = { KERNEL(decode_scalar), KERNEL(decode_scalar), KERNEL(decode_scalar),
+	  KERNEL(decode_scalar) },
+#endif
+};
+
+#undef KERNEL
+#undef ALPHABET
+#undef CHAR_62
+#undef CHAR_63
+#undef VALUES
+#undef DEC_LUT_LO
+#undef DEC_ROLL
+#undef DEC_SPECIAL
+#undef DEC_BUMP
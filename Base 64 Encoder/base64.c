@@ -3,81 +3,418 @@
 #include <stdint.h> // Extra fixed-width data types
 #include <string.h> // String utilities
 #include <err.h>    // Convenience functions for error reporting (non-standard)
+#include <unistd.h> // getopt(), read(), write()
+#include <fcntl.h>  // open()
+#include <sys/stat.h> // fstat()
+#include <pthread.h> // Worker threads for -j
+#include <stdatomic.h> // Lock-free chunk counter
+#include <stdlib.h> // malloc(), strtol()
 
-static char const b64_alphabet[] =
-  "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-  "abcdefghijklmnopqrstuvwxyz"
-  "0123456789"
-  "+/";
+#include "b64.h"
+#include "base64_io.h"
 
-int main(int argc, char *argv[])
+/* Output format chosen on the command line */
+static struct b64_options opts = B64_MIME_OPTIONS;
+
+/* Overlapped encoding (-a). A reader thread prefetches input blocks into a
+ * ring while this thread encodes, and a writer thread drains encoded blocks
+ * from a second ring, so wall time tends to max(read, encode, write) rather
+ * than their sum. */
+#define RING_BLOCKS 4
+
+struct ring {
+	struct {
+		void const *data;	/* Block contents; may point into a mapping */
+		size_t len;
+		int last;		/* No blocks follow this one */
+	} blocks[RING_BLOCKS];
+	char *bufs[RING_BLOCKS];	/* Backing storage for each block */
+	size_t head;			/* Blocks published by the producer */
+	size_t tail;			/* Blocks released by the consumer */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void
+ring_init(struct ring *ring, size_t block_size)
 {
-	FILE * file = NULL;
-	if (argc > 2) {
-    		errno = EINVAL; 		/* "Invalid Argument" */
-    		err(1, "Too many arguments");
-	} else if (argc == 2 && strcmp(argv[1], "-")){
-    		file = fopen(argv[1], "rb");	/* Open FILE */
-    		if (file == NULL) {
-        		err(1, "Error Opening the File");
-    		}
-	} else {
-    		file = stdin; 			/* Use stdin instead */
+	ring->head = ring->tail = 0;
+	for (int i = 0; i < RING_BLOCKS; i++) {
+		if ((ring->bufs[i] = malloc(block_size)) == NULL) err(1, "malloc");
+	}
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+}
+
+static void
+ring_destroy(struct ring *ring)
+{
+	for (int i = 0; i < RING_BLOCKS; i++) {
+		free(ring->bufs[i]);
 	}
+	pthread_mutex_destroy(&ring->mutex);
+	pthread_cond_destroy(&ring->cond);
+}
+
+/* Producer side: waits for a free block and returns its index. */
+static int
+ring_acquire_free(struct ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	while (ring->head - ring->tail == RING_BLOCKS) {
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	}
+	int i = ring->head % RING_BLOCKS;
+	pthread_mutex_unlock(&ring->mutex);
+	return i;
+}
+
+static void
+ring_publish(struct ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->head++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Consumer side: waits for a published block and returns its index. */
+static int
+ring_acquire_full(struct ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	while (ring->head == ring->tail) {
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	}
+	int i = ring->tail % RING_BLOCKS;
+	pthread_mutex_unlock(&ring->mutex);
+	return i;
+}
+
+static void
+ring_release(struct ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	ring->tail++;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+struct async_job {
+	struct input *in;
+	struct ring input_ring;
+	struct ring output_ring;
+};
+
+static void *
+async_reader(void *arg)
+{
+	struct async_job *job = arg;
+	struct ring *ring = &job->input_ring;
+	for (;;) {
+		int i = ring_acquire_free(ring);
+		size_t want = (size_t)LINE_BYTES * BLOCK_LINES;
+		ring->blocks[i].len = input_next(job->in, &ring->blocks[i].data, ring->bufs[i], want);
+		ring->blocks[i].last = ring->blocks[i].len < want;
+		ring_publish(ring);
+		if (ring->blocks[i].last) return NULL;
+	}
+}
+
+static void *
+async_writer(void *arg)
+{
+	struct async_job *job = arg;
+	struct ring *ring = &job->output_ring;
+	for (;;) {
+		int i = ring_acquire_full(ring);
+		write_all(STDOUT_FILENO, ring->blocks[i].data, ring->blocks[i].len);
+		int last = ring->blocks[i].last;
+		ring_release(ring);
+		if (last) return NULL;
+	}
+}
+
+static void
+encode_async(struct input *in)
+{
+	struct async_job job = { .in = in };
+	struct b64_encoder enc;
+	b64_encoder_init(&enc, opts);
+	size_t block = (size_t)LINE_BYTES * BLOCK_LINES;
+	ring_init(&job.input_ring, block);
+	ring_init(&job.output_ring, b64_encode_bound(&enc, block + 2) + B64_ENCODE_FINAL_MAX);
+
+	pthread_t reader, writer;
+	if ((errno = pthread_create(&reader, NULL, async_reader, &job))) err(1, "pthread_create");
+	if ((errno = pthread_create(&writer, NULL, async_writer, &job))) err(1, "pthread_create");
+
+	int last = 0;
+	while (!last) {
+		int i = ring_acquire_full(&job.input_ring);
+		int o = ring_acquire_free(&job.output_ring);
+		char *out = job.output_ring.bufs[o];
+		size_t n_out = b64_encode_update(&enc, job.input_ring.blocks[i].data,
+		  job.input_ring.blocks[i].len, out);
+		last = job.input_ring.blocks[i].last;
+		if (last) n_out += b64_encode_final(&enc, out + n_out);
+		ring_release(&job.input_ring);
+
+		job.output_ring.blocks[o].data = out;
+		job.output_ring.blocks[o].len = n_out;
+		job.output_ring.blocks[o].last = last;
+		ring_publish(&job.output_ring);
+	}
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+	ring_destroy(&job.input_ring);
+	ring_destroy(&job.output_ring);
+}
 
-	int char_count = 0;			/* Counter to keep track of characters */
+/* Parallel encoding (-j N). Input is split into chunks that hold a whole
+ * number of groups and of lines, so every chunk starts on a line boundary, its
+ * output is independent and its output offset is the encoded size of
+ * everything before it. */
+static size_t
+chunk_bytes(size_t wrap)
+{
+	/* Smallest span of characters that is both whole groups and whole
+	 * lines: lcm(wrap, 4). */
+	size_t unit = 4;
+	if (wrap) unit = wrap % 4 == 0 ? wrap : wrap % 2 == 0 ? wrap * 2 : wrap * 4;
+	size_t unit_bytes = unit / 4 * 3;
+	size_t units = (size_t)LINE_BYTES * BLOCK_LINES / unit_bytes;
+	return unit_bytes * (units > 0 ? units : 1);
+}
+
+/* One encoded chunk waiting for the writer when stdout is not seekable. */
+struct slot {
+	char *buf;
+	size_t len;
+	size_t seq;
+	int ready;
+};
+
+struct parallel_job {
+	uint8_t const *in;
+	size_t len;
+	size_t chunk_bytes;
+	size_t chunk_chars;		/* Encoded size of a full chunk */
+	size_t nchunks;
+	atomic_size_t next;		/* Next chunk to claim */
+
+	/* pwrite() mode: chunks land directly at out_base + seq * chunk_chars */
+	int use_pwrite;
+	off_t out_base;
+
+	/* Ordered handoff mode: a ring of 2N slots drained in order by main() */
+	struct slot *slots;
+	size_t nslots;
+	size_t written;			/* Chunks already written out */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void *
+parallel_worker(void *arg)
+{
+	struct parallel_job *job = arg;
+	char *local = NULL;
+	if (job->use_pwrite && (local = malloc(job->chunk_chars)) == NULL) err(1, "malloc");
 
 	for (;;) {
-    		uint8_t input_bytes[3] = {0};
-    		size_t n_read = fread(input_bytes, 1, 3, file);
-    		if (n_read != 0){
-        	
-			int alph_ind[4];
-        		alph_ind[0] = input_bytes[0] >> 2;
-        		alph_ind[1] = (input_bytes[0] << 4 | input_bytes[1] >> 4) & 0x3Fu;
-        		alph_ind[2] = (input_bytes[1] << 2 | input_bytes[2] >> 6) & 0x3Fu;
-			alph_ind[3] = input_bytes[2] & 0x3Fu;
-			
-			char output[5];
-        		output[0] = b64_alphabet[alph_ind[0]];
-        		output[1] = b64_alphabet[alph_ind[1]];
-			if (n_read >= 2) {
-				output[2] = b64_alphabet[alph_ind[2]];
-			} else {
-				output[2] = '=';
+		size_t seq = atomic_fetch_add(&job->next, 1);
+		if (seq >= job->nchunks) break;
+		size_t off = seq * job->chunk_bytes;
+		size_t n = job->len - off < job->chunk_bytes ? job->len - off : job->chunk_bytes;
+
+		if (job->use_pwrite) {
+			size_t n_out = b64_encode(job->in + off, n, local, opts);
+			off_t pos = job->out_base + (off_t)(seq * job->chunk_chars);
+			for (size_t done = 0; done < n_out;) {
+				ssize_t w = pwrite(STDOUT_FILENO, local + done, n_out - done, pos + done);
+				if (w == -1) {
+					if (errno == EINTR) continue;
+					err(1, "Failed to write."); /* Write error */
+				}
+				done += w;
 			}
-			if (n_read == 3) {
-				output[3] = b64_alphabet[alph_ind[3]];
-			} else {
-				output[3] = '=';
+			continue;
+		}
+
+		/* Wait until the writer has drained the chunk that last used
+		 * this slot, encode straight into it, then hand it over. */
+		struct slot *slot = &job->slots[seq % job->nslots];
+		pthread_mutex_lock(&job->mutex);
+		while (seq >= job->written + job->nslots) {
+			pthread_cond_wait(&job->cond, &job->mutex);
+		}
+		pthread_mutex_unlock(&job->mutex);
+
+		size_t n_out = b64_encode(job->in + off, n, slot->buf, opts);
+
+		pthread_mutex_lock(&job->mutex);
+		slot->len = n_out;
+		slot->seq = seq;
+		slot->ready = 1;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->mutex);
+	}
+	free(local);
+	return NULL;
+}
+
+/* Encodes a mapped input with `nthreads` workers. Chunks are pwrite()n in
+ * place when stdout is a regular file, otherwise written in order by this
+ * thread as workers finish them. */
+static void
+encode_parallel(struct input *in, int nthreads)
+{
+	struct parallel_job job = {
+		.in = in->map + in->pos,
+		.len = in->map_len - in->pos,
+	};
+	job.chunk_bytes = chunk_bytes(opts.wrap);
+	job.chunk_chars = b64_encoded_size(job.chunk_bytes, opts);
+	job.nchunks = (job.len + job.chunk_bytes - 1) / job.chunk_bytes;
+	atomic_init(&job.next, 0);
+
+	/* pwrite() ignores the offset under O_APPEND, so that falls back to
+	 * the ordered handoff as well. */
+	struct stat st;
+	int flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode) && flags != -1 && !(flags & O_APPEND)) {
+		job.out_base = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		job.use_pwrite = job.out_base != -1;
+	}
+
+	if (!job.use_pwrite) {
+		job.nslots = 2 * (size_t)nthreads;
+		if ((job.slots = calloc(job.nslots, sizeof *job.slots)) == NULL) err(1, "calloc");
+		for (size_t i = 0; i < job.nslots; i++) {
+			if ((job.slots[i].buf = malloc(job.chunk_chars)) == NULL) err(1, "malloc");
+		}
+		pthread_mutex_init(&job.mutex, NULL);
+		pthread_cond_init(&job.cond, NULL);
+	}
+
+	pthread_t *tids = malloc(nthreads * sizeof *tids);
+	if (tids == NULL) err(1, "malloc");
+	for (int i = 0; i < nthreads; i++) {
+		if ((errno = pthread_create(&tids[i], NULL, parallel_worker, &job))) {
+			err(1, "pthread_create");
+		}
+	}
+
+	if (!job.use_pwrite) {
+		for (size_t seq = 0; seq < job.nchunks; seq++) {
+			struct slot *slot = &job.slots[seq % job.nslots];
+			pthread_mutex_lock(&job.mutex);
+			while (!slot->ready || slot->seq != seq) {
+				pthread_cond_wait(&job.cond, &job.mutex);
 			}
-			output[4] = '\0';						     
+			pthread_mutex_unlock(&job.mutex);
 
-       		 	size_t n_write = fwrite(output, 1, 4, stdout); 
-        		if (ferror(stdout)) err(1, "Failed to write."); /* Write error */
+			write_all(STDOUT_FILENO, slot->buf, slot->len);
 
-			char_count += n_write;
+			pthread_mutex_lock(&job.mutex);
+			slot->ready = 0;
+			job.written = seq + 1;
+			pthread_cond_broadcast(&job.cond);
+			pthread_mutex_unlock(&job.mutex);
+		}
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	free(tids);
+
+	if (job.use_pwrite) {
+		/* Leave the file offset after our output, as write() would. */
+		size_t total = b64_encoded_size(job.len, opts);
+		if (lseek(STDOUT_FILENO, job.out_base + (off_t)total, SEEK_SET) == -1) err(1, "lseek");
+	} else {
+		for (size_t i = 0; i < job.nslots; i++) {
+			free(job.slots[i].buf);
+		}
+		free(job.slots);
+		pthread_mutex_destroy(&job.mutex);
+		pthread_cond_destroy(&job.cond);
+	}
+}
 
-			if (char_count >= 76) {
-				putchar('\n');
-				fflush(stdout);
-				char_count = 0;
+int main(int argc, char *argv[])
+{
+	int decode = 0;
+	int async = 0;
+	int nthreads = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "adj:nuw:")) != -1) {
+		char *end;
+		long wrap;
+		switch (opt) {
+		case 'a':
+			async = 1;		/* Overlap reading, encoding and writing */
+			break;
+		case 'd':
+			decode = 1;		/* Decode instead of encode */
+			break;
+		case 'n':
+			opts.pad = 0;		/* Omit '=' padding */
+			break;
+		case 'u':
+			opts.alphabet = B64_URLSAFE;	/* '-' and '_' instead of '+' and '/' */
+			break;
+		case 'w':
+			wrap = strtol(optarg, &end, 10);	/* Line length, 0 for none */
+			if (*end != '\0' || wrap < 0) {
+				errx(1, "Invalid wrap width: %s", optarg);
+			}
+			opts.wrap = wrap;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, &end, 10);	/* Encoder threads */
+			if (*end != '\0' || nthreads < 1 || nthreads > 1024) {
+				errx(1, "Invalid thread count: %s", optarg);
 			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d] [-anu] [-w COLS] [-j N] [FILE]\n", argv[0]);
+			return 1;
 		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
-		if (n_read < 3) {
-       			if (feof(file)) break; /* End of file */
-       			if (ferror(file)) err(1, "Failed to read."); /* Read error */
+	int fd = -1;
+	if (argc > 2) {
+		errno = EINVAL; 		/* "Invalid Argument" */
+		err(1, "Too many arguments");
+	} else if (argc == 2 && strcmp(argv[1], "-")){
+		fd = open(argv[1], O_RDONLY);	/* Open FILE */
+		if (fd == -1) {
+			err(1, "Error Opening the File");
 		}
-    		
+	} else {
+		fd = STDIN_FILENO; 		/* Use stdin instead */
 	}
-	if (char_count > 0){
-		putchar('\n');
-		fflush(stdout);
+
+	struct input in;
+	input_open(&in, fd, 1);
+	if (decode) {
+		decode_stream(&in, STDOUT_FILENO, opts.alphabet);
+	} else if (nthreads > 1 && in.map) {
+		encode_parallel(&in, nthreads);	/* Only regular files can be split */
+	} else if (async) {
+		encode_async(&in);
+	} else {
+		encode_stream(&in, STDOUT_FILENO, opts);
 	}
+	input_close(&in);
 
-	if (file != stdin) {
-		fclose(file); 			/* Close opened file */
+	if (fd != STDIN_FILENO) {
+		close(fd); 			/* Close opened file */
 	}
-	fflush(stdout); 
 }
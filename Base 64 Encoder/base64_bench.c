@@ -0,0 +1,393 @@
+#define _GNU_SOURCE         // mkstemp()
+
+#include <stdio.h>  // Standard input and output
+#include <errno.h>  // Access to errno and Exxx macros
+#include <stdint.h> // Extra fixed-width data types
+#include <stdlib.h> // malloc(), strtoull()
+#include <string.h> // String utilities
+#include <err.h>    // Convenience functions for error reporting (non-standard)
+#include <time.h>   // clock_gettime()
+#include <unistd.h> // getopt(), read(), write()
+#include <fcntl.h>  // open()
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc()
+#define HAVE_RDTSC 1
+#endif
+
+#include "b64.h"
+#include "base64_io.h"
+
+/* Throughput benchmark and correctness cross-check for libb64.
+ *
+ * Every kernel the CPU supports is first checked against the scalar reference
+ * (all padding lengths, both alphabets, every wrap strategy and streaming in
+ * odd-sized pieces). Then each kernel and each I/O mode is timed on inputs
+ * from 1 byte up to -m bytes, growing 4x per step. Results are CSV on stdout:
+ *
+ *   benchmark,variant,alphabet,bytes,iterations,gb_per_s,cycles_per_byte
+ *
+ * cycles_per_byte counts TSC ticks, which run at the nominal clock rather than
+ * the current one; it is empty where there is no TSC.
+ */
+
+#define MIN_BENCH_BYTES (64ull << 20)	/* Work per measurement, so tiny inputs repeat */
+
+static char const *const alphabet_names[] = { "standard", "urlsafe" };
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t
+ticks(void)
+{
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void
+report(char const *benchmark, char const *variant, char const *alphabet, size_t bytes,
+       size_t iterations, double seconds, uint64_t cycles)
+{
+	double total = (double)bytes * iterations;
+	printf("%s,%s,%s,%zu,%zu,%.3f,", benchmark, variant, alphabet, bytes, iterations,
+	  total / seconds / 1e9);
+#ifdef HAVE_RDTSC
+	printf("%.3f", cycles / total);
+#else
+	(void)cycles;
+#endif
+	putchar('\n');
+	fflush(stdout);
+}
+
+/* Parses sizes such as 4096, 64K, 256M or 4G. */
+static size_t
+parse_size(char const *arg)
+{
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(arg, &end, 10);
+	switch (*end) {
+	case 'G': case 'g': n <<= 10; /* fall through */
+	case 'M': case 'm': n <<= 10; /* fall through */
+	case 'K': case 'k': n <<= 10; end++; break;
+	}
+	if (errno || *end != '\0' || n == 0) errx(1, "Invalid size: %s", arg);
+	return n;
+}
+
+static void
+fill_random(uint8_t *buf, size_t len)
+{
+	uint64_t x = 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = x;
+	}
+}
+
+/* Cross-check. */
+
+static int failures;
+
+static void
+check(int ok, char const *what, char const *variant, int alphabet, size_t len)
+{
+	if (ok) return;
+	fprintf(stderr, "MISMATCH: %s (%s, %s) at %zu bytes\n", what, variant,
+	  alphabet_names[alphabet], len);
+	failures++;
+}
+
+/* Encodes `in` with the given kernel forced into the encoder, `step` bytes per
+ * update call. Returns the number of characters written. */
+static size_t
+encode_with(b64_encode_kernel kernel, struct b64_options opts, uint8_t const *in, size_t len,
+	    size_t step, char *out)
+{
+	struct b64_encoder enc;
+	b64_encoder_init(&enc, opts);
+	enc.kernel = kernel;
+	char *p = out;
+	for (size_t i = 0; i < len; i += step) {
+		size_t n = len - i < step ? len - i : step;
+		p += b64_encode_update(&enc, in + i, n, p);
+	}
+	return p - out + b64_encode_final(&enc, p);
+}
+
+static void
+cross_check(uint8_t const *data, size_t max_len)
+{
+	size_t const wraps[] = { 0, B64_MIME_WRAP, 7 };
+	size_t const steps[] = { 1, 5, 57, (size_t)-1 };
+	char *ref = malloc(2 * max_len + 64);
+	char *out = malloc(2 * max_len + 64);
+	uint8_t *back = malloc(max_len + 64);
+	if (!ref || !out || !back) err(1, "malloc");
+
+	for (int alphabet = B64_STANDARD; alphabet <= B64_URLSAFE; alphabet++) {
+		b64_encode_kernel scalar = b64_encode_kernel_at(alphabet, 0);
+		for (int level = 0; level <= b64_cpu_level(); level++) {
+			char const *name = b64_level_name(level);
+			b64_encode_kernel enc = b64_encode_kernel_at(alphabet, level);
+			b64_decode_kernel dec = b64_decode_kernel_at(alphabet, level);
+
+			/* Every length up to 300 covers each padding case at each
+			 * position relative to the vector widths. */
+			for (size_t len = 0; len <= max_len; len = len < 300 ? len + 1 : len * 3 + 1) {
+				size_t n_ref = scalar(data, len, ref);
+				size_t n_out = enc(data, len, out);
+				check(n_out == n_ref && !memcmp(out, ref, n_ref / 3 * 4), "encode kernel",
+				  name, alphabet, len);
+				size_t n_back = dec(out, n_out / 3 * 4, back);
+				check(n_back == n_out / 3 * 4 && !memcmp(back, data, n_out), "decode kernel",
+				  name, alphabet, len);
+
+				for (size_t w = 0; w < sizeof wraps / sizeof *wraps; w++) {
+					for (int pad = 0; pad <= 1; pad++) {
+						struct b64_options opts = { alphabet, wraps[w], pad };
+						size_t expect = b64_encoded_size(len, opts);
+						n_ref = encode_with(scalar, opts, data, len, (size_t)-1, ref);
+						check(n_ref == expect, "encoded size", name, alphabet, len);
+						for (size_t s = 0; s < sizeof steps / sizeof *steps; s++) {
+							n_out = encode_with(enc, opts, data, len, steps[s], out);
+							check(n_out == n_ref && !memcmp(out, ref, n_ref), "streaming encoder",
+							  name, alphabet, len);
+						}
+
+						struct b64_decoder d;
+						size_t n_dec, n_fin;
+						b64_decoder_init(&d, alphabet);
+						d.kernel = dec;
+						int rc = b64_decode_update(&d, out, n_out, back, &n_dec);
+						rc |= b64_decode_final(&d, back + n_dec, &n_fin);
+						check(rc == 0 && n_dec + n_fin == len && !memcmp(back, data, len),
+						  "decoder round trip", name, alphabet, len);
+					}
+				}
+			}
+		}
+	}
+	free(ref);
+	free(out);
+	free(back);
+}
+
+/* Kernel throughput. */
+
+static size_t
+iterations_for(size_t bytes)
+{
+	return bytes >= MIN_BENCH_BYTES ? 1 : MIN_BENCH_BYTES / bytes;
+}
+
+static void
+bench_kernels(uint8_t const *data, size_t bytes, char *chars, uint8_t *back)
+{
+	size_t iters = iterations_for(bytes);
+	for (int alphabet = B64_STANDARD; alphabet <= B64_URLSAFE; alphabet++) {
+		char const *aname = alphabet_names[alphabet];
+		size_t n_chars = b64_encode_kernel_at(alphabet, 0)(data, bytes, chars) / 3 * 4;
+
+		for (int level = 0; level <= b64_cpu_level(); level++) {
+			b64_encode_kernel enc = b64_encode_kernel_at(alphabet, level);
+			double t = now();
+			uint64_t c = ticks();
+			for (size_t i = 0; i < iters; i++) {
+				enc(data, bytes, chars);
+				__asm__ volatile("" : : "r"(chars) : "memory");
+			}
+			c = ticks() - c;
+			report("encode_kernel", b64_level_name(level), aname, bytes, iters, now() - t, c);
+		}
+
+		for (int level = 0; level <= b64_cpu_level(); level++) {
+			b64_decode_kernel dec = b64_decode_kernel_at(alphabet, level);
+			if (level > 0 && dec == b64_decode_kernel_at(alphabet, level - 1)) continue;
+			if (n_chars == 0) continue;
+			double t = now();
+			uint64_t c = ticks();
+			for (size_t i = 0; i < iters; i++) {
+				dec(chars, n_chars, back);
+				__asm__ volatile("" : : "r"(back) : "memory");
+			}
+			c = ticks() - c;
+			report("decode_kernel", b64_level_name(level), aname, n_chars, iters, now() - t, c);
+		}
+
+		/* The full streaming encoder, including MIME line breaks. */
+		struct b64_options opts = { alphabet, B64_MIME_WRAP, 1 };
+		double t = now();
+		uint64_t c = ticks();
+		for (size_t i = 0; i < iters; i++) {
+			b64_encode(data, bytes, chars, opts);
+			__asm__ volatile("" : : "r"(chars) : "memory");
+		}
+		c = ticks() - c;
+		report("encode_mime", b64_level_name(b64_cpu_level()), aname, bytes, iters, now() - t, c);
+	}
+}
+
+/* I/O modes, each encoding `path` to /dev/null. "stdio" is the original
+ * base64.c: a 3-byte fread() and a 4-byte fwrite() per group. "block" and
+ * "mmap" are the CLI's own read() and mapped paths from base64_io.c. */
+
+static char const b64_alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+  "abcdefghijklmnopqrstuvwxyz"
+  "0123456789"
+  "+/";
+
+static void
+io_stdio(char const *path, int devnull)
+{
+	(void)devnull;
+	FILE *file = fopen(path, "rb");
+	FILE *sink = fopen("/dev/null", "wb");
+	if (!file || !sink) err(1, "fopen");
+
+	int char_count = 0;
+	for (;;) {
+		uint8_t input_bytes[3] = {0};
+		size_t n_read = fread(input_bytes, 1, 3, file);
+		if (n_read != 0) {
+			char output[4];
+			output[0] = b64_alphabet[input_bytes[0] >> 2];
+			output[1] = b64_alphabet[(input_bytes[0] << 4 | input_bytes[1] >> 4) & 0x3Fu];
+			output[2] = n_read >= 2 ? b64_alphabet[(input_bytes[1] << 2 | input_bytes[2] >> 6) & 0x3Fu] : '=';
+			output[3] = n_read == 3 ? b64_alphabet[input_bytes[2] & 0x3Fu] : '=';
+
+			size_t n_write = fwrite(output, 1, 4, sink);
+			if (ferror(sink)) err(1, "Failed to write.");
+			char_count += n_write;
+			if (char_count >= 76) {
+				putc('\n', sink);
+				fflush(sink);
+				char_count = 0;
+			}
+		}
+		if (n_read < 3) {
+			if (feof(file)) break;
+			if (ferror(file)) err(1, "Failed to read.");
+		}
+	}
+	if (char_count > 0) putc('\n', sink);
+	fclose(file);
+	fclose(sink);
+}
+
+static void
+io_input(char const *path, int devnull, int use_map)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) err(1, "open");
+	struct input in;
+	input_open(&in, fd, use_map);
+	encode_stream(&in, devnull, B64_MIME_OPTIONS);
+	input_close(&in);
+	close(fd);
+}
+
+static void
+io_block(char const *path, int devnull)
+{
+	io_input(path, devnull, 0);
+}
+
+static void
+io_mmap(char const *path, int devnull)
+{
+	io_input(path, devnull, 1);
+}
+
+static void
+bench_io(uint8_t const *data, size_t bytes)
+{
+	static struct {
+		char const *name;
+		void (*run)(char const *path, int devnull);
+	} const modes[] = { { "stdio", io_stdio }, { "block", io_block }, { "mmap", io_mmap } };
+
+	char path[] = "/tmp/base64_bench.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) err(1, "mkstemp");
+	for (size_t off = 0; off < bytes;) {
+		ssize_t w = write(fd, data + off, bytes - off);
+		if (w == -1) err(1, "write");
+		off += w;
+	}
+	close(fd);
+
+	int devnull = open("/dev/null", O_WRONLY);
+	if (devnull == -1) err(1, "open");
+
+	/* Files are re-read from the page cache, so this measures syscall and
+	 * copy overhead rather than the disk. */
+	size_t iters = iterations_for(bytes);
+	for (size_t m = 0; m < sizeof modes / sizeof *modes; m++) {
+		double t = now();
+		uint64_t c = ticks();
+		for (size_t i = 0; i < iters; i++) {
+			modes[m].run(path, devnull);
+		}
+		c = ticks() - c;
+		report("encode_io", modes[m].name, "standard", bytes, iters, now() - t, c);
+	}
+
+	close(devnull);
+	unlink(path);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t max_bytes = 256u << 20;
+	int check_only = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "cm:")) != -1) {
+		switch (opt) {
+		case 'c':
+			check_only = 1;		/* Cross-check only, no timing */
+			break;
+		case 'm':
+			max_bytes = parse_size(optarg);	/* Largest input size */
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c] [-m MAXBYTES]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	uint8_t *data = malloc(max_bytes);
+	char *chars = malloc(b64_encoded_size(max_bytes, B64_MIME_OPTIONS) + 64);
+	uint8_t *back = malloc(max_bytes + 64);
+	if (!data || !chars || !back) err(1, "malloc");
+	fill_random(data, max_bytes);
+
+	cross_check(data, max_bytes < (1u << 20) ? max_bytes : 1u << 20);
+	if (failures) errx(1, "%d mismatches against the scalar reference", failures);
+	fprintf(stderr, "cross-check passed (cpu level: %s)\n", b64_level_name(b64_cpu_level()));
+	if (check_only) return 0;
+
+	printf("benchmark,variant,alphabet,bytes,iterations,gb_per_s,cycles_per_byte\n");
+	for (size_t bytes = 1; bytes <= max_bytes; bytes = bytes * 4 < bytes ? max_bytes + 1 : bytes * 4) {
+		bench_kernels(data, bytes, chars, back);
+		if (bytes >= 4096) bench_io(data, bytes);
+	}
+
+	free(data);
+	free(chars);
+	free(back);
+	return 0;
+}
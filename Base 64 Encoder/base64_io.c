@@ -0,0 +1,128 @@
+#include <stdio.h>  // Standard input and output
+#include <errno.h>  // Access to errno and Exxx macros
+#include <stdint.h> // Extra fixed-width data types
+#include <stdlib.h> // malloc()
+#include <err.h>    // Convenience functions for error reporting (non-standard)
+#include <unistd.h> // read(), write()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+
+#include "base64_io.h"
+
+void
+input_open(struct input *in, int fd, int use_map)
+{
+	struct stat st;
+	in->fd = fd;
+	in->map = NULL;
+	in->map_len = 0;
+	in->pos = 0;
+	if (!use_map) return;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return;
+
+	/* Map from the current offset so "base64 < file" after a seek still
+	 * starts where the shell left it. */
+	off_t start = lseek(fd, 0, SEEK_CUR);
+	if (start == -1 || start >= st.st_size) return;
+	off_t page = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	void *map = mmap(NULL, st.st_size - page, PROT_READ, MAP_PRIVATE, fd, page);
+	if (map == MAP_FAILED) return; /* Fall back to read() */
+	madvise(map, st.st_size - page, MADV_SEQUENTIAL);
+	in->map = map;
+	in->map_len = st.st_size - page;
+	in->pos = start - page;
+}
+
+void
+input_close(struct input *in)
+{
+	if (in->map) munmap((void *)in->map, in->map_len);
+}
+
+size_t
+input_next(struct input *in, void const **data, void *buf, size_t want)
+{
+	if (in->map) {
+		size_t n = in->map_len - in->pos;
+		if (n > want) n = want;
+		*data = in->map + in->pos;
+		in->pos += n;
+		return n;
+	}
+
+	size_t n = 0;
+	while (n < want) {
+		ssize_t r = read(in->fd, (char *)buf + n, want - n);
+		if (r == 0) break; /* End of file */
+		if (r == -1) {
+			if (errno == EINTR) continue;
+			err(1, "Failed to read."); /* Read error */
+		}
+		n += r;
+	}
+	*data = buf;
+	return n;
+}
+
+void
+write_all(int fd, void const *buf, size_t len)
+{
+	char const *p = buf;
+	while (len > 0) {
+		ssize_t w = write(fd, p, len);
+		if (w == -1) {
+			if (errno == EINTR) continue;
+			err(1, "Failed to write."); /* Write error */
+		}
+		p += w;
+		len -= w;
+	}
+}
+
+void
+decode_stream(struct input *in, int out_fd, int alphabet)
+{
+	static _Alignas(64) char input_chars[DECODE_CHUNK];
+	static _Alignas(64) uint8_t output[DECODE_CHUNK / 4 * 3 + 3];
+	struct b64_decoder dec;
+	b64_decoder_init(&dec, alphabet);
+
+	for (;;) {
+		void const *data;
+		size_t n_out, n_read = input_next(in, &data, input_chars, sizeof input_chars);
+		if (n_read == 0) break; /* End of file */
+		if (b64_decode_update(&dec, data, n_read, output, &n_out) == -1) break;
+		write_all(out_fd, output, n_out);
+	}
+
+	size_t n_out;
+	if (dec.error || b64_decode_final(&dec, output, &n_out) == -1) {
+		if (dec.error == B64_EINVAL || dec.error == B64_ETRAILING) {
+			errx(1, "%s 0x%02x at byte offset %lld", b64_strerror(dec.error), dec.bad_char, dec.offset);
+		}
+		errx(1, "%s at byte offset %lld", b64_strerror(dec.error), dec.offset);
+	}
+	write_all(out_fd, output, n_out);
+}
+
+void
+encode_stream(struct input *in, int out_fd, struct b64_options opts)
+{
+	static _Alignas(64) uint8_t input_bytes[LINE_BYTES * BLOCK_LINES];
+	struct b64_encoder enc;
+	b64_encoder_init(&enc, opts);
+
+	/* Sized for the worst case: a block completing a carried group. */
+	char *output = malloc(b64_encode_bound(&enc, sizeof input_bytes + 2) + B64_ENCODE_FINAL_MAX);
+	if (output == NULL) err(1, "malloc");
+
+	for (;;) {
+		void const *data;
+		size_t n_read = input_next(in, &data, input_bytes, sizeof input_bytes);
+		if (n_read == 0) break; /* End of file */
+		size_t n_out = b64_encode_update(&enc, data, n_read, output);
+		write_all(out_fd, output, n_out);
+	}
+	write_all(out_fd, output, b64_encode_final(&enc, output));
+	free(output);
+}
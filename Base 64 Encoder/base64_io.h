@@ -0,0 +1,46 @@
+#ifndef BASE64_IO_H
+#define BASE64_IO_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+
+#include "b64.h"
+
+/* The base64 CLI's input and output paths, shared with base64_bench so that
+ * the benchmark times the same code the CLI runs. Errors are fatal, as in
+ * the CLI: they are reported with err() and exit. */
+
+#define LINE_BYTES (B64_MIME_WRAP / 4 * 3)	/* Input bytes per full line (57) */
+#define BLOCK_LINES 4096			/* Lines encoded per write() */
+#define DECODE_CHUNK (256 * 1024)		/* Characters decoded per write() */
+
+/* Input source. Regular files are mapped and handed out in place; anything
+ * else (pipes, terminals, sockets) is read() into the caller's buffer. */
+struct input {
+	int fd;
+	uint8_t const *map;
+	size_t map_len;
+	size_t pos;
+};
+
+/* Starts reading `fd` from its current offset, mapping it if `use_map` is
+ * set and it is a regular file. */
+extern void input_open(struct input *in, int fd, int use_map);
+extern void input_close(struct input *in);
+
+/* Makes up to `want` bytes available at *data and returns how many. Anything
+ * less than `want` means end of input. */
+extern size_t input_next(struct input *in, void const **data, void *buf, size_t want);
+
+/* Writes all of `buf`, retrying short writes. */
+extern void write_all(int fd, void const *buf, size_t len);
+
+/* Encodes `in` to `out_fd` one block of BLOCK_LINES (MIME) lines at a time,
+ * so there is one write() per block regardless of how many lines it holds. */
+extern void encode_stream(struct input *in, int out_fd, struct b64_options opts);
+
+/* Decodes `in` to `out_fd` DECODE_CHUNK characters at a time, exiting with a
+ * message at the first bad character. */
+extern void decode_stream(struct input *in, int out_fd, int alphabet);
+
+#endif
@@ -0,0 +1,7 @@
+#!/bin/bash
+gcc -O2 -fPIC -c -o b64.o b64.c
+ar rcs libb64.a b64.o
+gcc -shared -o libb64.so b64.o
+gcc -O2 -c -o base64_io.o base64_io.c
+gcc -O2 -pthread -o base64 base64.c base64_io.o libb64.a
+gcc -O2 -o base64_bench base64_bench.c base64_io.o libb64.a
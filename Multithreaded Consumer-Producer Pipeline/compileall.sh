@@ -0,0 +1,6 @@
+#!/bin/bash
+gcc -O2 -c -o pipeline.o pipeline.c
+gcc -O2 -c -o text.o text.c
+gcc -O2 -pthread -o mtp mtp.c pipeline.o text.o
+gcc -O2 -pthread -o pipeline_bench pipeline_bench.c pipeline.o
+gcc -O2 -pthread -o mtp_bench mtp_bench.c pipeline.o text.o
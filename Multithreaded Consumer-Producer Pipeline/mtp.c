@@ -1,233 +1,527 @@
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-// Size of the buffer
-#define MAX_LENGTH 1001
+#include "pipeline.h"
+#include "text.h"
+
+// Lines processed unless streaming with -s
 #define MAX_LINES 50
 
+// Lines moved per ring operation, and how long the input stage holds on
+// to a partial batch while no input arrives. Set with -b and -t.
+#define BATCH_SIZE 16
+#define FLUSH_TIMEOUT_MS 1
+
+// Input handed to a worker at a time with -w, and how many chunks can be
+// read, in progress or waiting to be written at once
+#define CHUNK_SIZE 65536
+#define CHUNK_SLOTS 64
+#define MAX_WORKERS 32
+
 // Output lines are always 80 character long.
 #define MAX_OUTPUT_LENGTH 80
 
-typedef struct {
-    // Buffer, shared resource
-    char lines[MAX_LINES][MAX_LENGTH]; 
-
-    // Number of items in the buffer, shared resource
-    int items_in_buf; 
-    
-    // Index where the consumer will pick up the next item
-    int producer_index;
-    
-    // Index where the consumer will pick up the next item
-    int consumer_index;
+// Output lines staged before they are written out together
+#define OUTPUT_LINES 512
+
+// Stop after MAX_LINES lines, or 0 to stream until STOP or the end of input
+int max_lines = MAX_LINES;
+int batch_size = BATCH_SIZE;
+int flush_timeout = FLUSH_TIMEOUT_MS;
+// Worker threads for -w, or 0 for one thread per stage
+int workers = 0;
+// Run the two transforms on one thread (-f)
+bool fuse = false;
+// How threads wait on the rings (-W)
+int wait_policy = PIPELINE_WAIT_CONDVAR;
+// Print statistics at exit (-S), and in JSON rather than as a table
+bool stats_at_exit = false;
+bool stats_json = false;
+// CPUs to pin the threads to in order (-c), used again from the start if
+// there are more threads, or chosen from the topology with -c auto
+int thread_cpus[MAX_WORKERS + 2];
+int ncpus = 0;
+bool place_auto = false;
+
+Pipeline pipeline;
+
+Input input;
+
+// Where read_piece is in the input
+bool line_start = true;
+int lines_read = 0;
+
+// Input's fill function: read standard input.
+ssize_t read_stdin(void* state, char* buffer, size_t size){
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, buffer, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fprintf(stderr, "Failed to read input\n");
+        }
+        return n;
+    }
+}
 
-    // Initialize the mutex
-    pthread_mutex_t mutex;
-    pthread_cond_t full;
-} Buffer;
+/* True if the next read_piece will not block, waiting up to timeout
+ * milliseconds for more input to arrive. */
+bool input_ready(int timeout){
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    if (input_buffered(&input)) {
+        return true;
+    }
+    return poll(&pfd, 1, timeout) != 0;
+}
 
-// Declare buffers.
-Buffer buffer1;
-Buffer buffer2;
-Buffer buffer3;
+/* Point text at the next piece of input and store its length. Returns false
+ * instead once the input is over: at a "STOP\n" line, at the end of the file
+ * or after max_lines lines. */
+bool read_piece(char** text, size_t* length){
+    if (max_lines > 0 && lines_read == max_lines) {
+        return false;
+    }
+    *length = input_piece(&input, text);
 
-// From EdDiscussion
-char output_buffer[50000];
+    // Check if the input line is "STOP\n"
+    if (*length == 0 || (line_start && *length == 5 && !memcmp(*text, "STOP\n", 5))) {
+        return false;
+    }
+    line_start = (*text)[*length - 1] == '\n';
+    if (line_start) {
+        lines_read++;
+    }
+    return true;
+}
 
-// Initialize the condition variables
-pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Stage 1, called the Input Stage, reads in lines of
+ * characters from the standard input. */
+bool read_input(void* state, Line* line){
+    return read_piece(&line->text, &line->length);
+}
 
-// Initialize a buffer
-void init_buffer(Buffer* buffer){
-    buffer->items_in_buf = 0;
-    buffer->producer_index = 0;
-    buffer->consumer_index = 0;
-    pthread_mutex_init(&buffer->mutex, NULL);
-    pthread_cond_init(&buffer->full, NULL);
+bool input_waiting(void* state, int timeout){
+    return input_ready(timeout);
 }
 
-// Destroy a buffer and release associated resources.
-void destroy_buffer(Buffer* buffer){
-    pthread_mutex_destroy(&buffer->mutex);
-    pthread_cond_destroy(&buffer->full);
+/* Stage 2, called the Line Separator Stage, replaces
+ * every line separator in the input by a space. */
+bool separate_lines(void* state, Line* line){
+    replace_separators(line->text, line->length);
+    return true;
 }
 
-// Put a line into the buffer.
-void put_buffer(Buffer* buffer, char* line) {
-    pthread_mutex_lock(&buffer->mutex); 
+/* Stage 3, called the Plus Sign Stage, replaces every
+ * pair of plus signs, i.e., "++", by a "^". */
+bool replace_plus_signs(void* state, Line* line){
+    line->length = replace_plus_pairs(line->text, line->length);
+    return true;
+}
 
-    // Check if the buffer is full.
-    while (buffer->items_in_buf == MAX_LINES) {
-        pthread_cond_wait(&buffer->full, &buffer->mutex);
+/* Output lines waiting to be written, in a circle of fixed 81-byte slots so
+ * a line never wraps around the end. The slot after the last complete line
+ * is the one being filled; it stays where it is when the lines before it are
+ * written, so the partial last line is never moved. */
+typedef struct {
+    char lines[OUTPUT_LINES][MAX_OUTPUT_LENGTH + 1];
+    size_t first;     // Oldest complete line
+    size_t complete;  // Complete lines waiting to be written
+    size_t filled;    // Characters in the line being filled
+} Output;
+
+// Write out every complete line, with at most two iovecs for the wrap.
+void flush_output(Output* out){
+    struct iovec iov[2];
+    int iovcnt = 0;
+    size_t end = out->first + out->complete;
+
+    if (out->complete == 0) {
+        return;
+    }
+    iov[iovcnt].iov_base = out->lines[out->first];
+    iov[iovcnt].iov_len = ((end > OUTPUT_LINES ? OUTPUT_LINES : end) - out->first) * (MAX_OUTPUT_LENGTH + 1);
+    iovcnt++;
+    if (end > OUTPUT_LINES) {
+        iov[iovcnt].iov_base = out->lines[0];
+        iov[iovcnt].iov_len = (end - OUTPUT_LINES) * (MAX_OUTPUT_LENGTH + 1);
+        iovcnt++;
     }
-    strcpy(buffer->lines[buffer->producer_index], line);
-    buffer->producer_index = (buffer->producer_index + 1) % MAX_LINES;
-    buffer->items_in_buf++;
-    pthread_cond_signal(&buffer->full); 
-    pthread_mutex_unlock(&buffer->mutex);  
-}
 
-// Get a line from the buffer.
-char* get_buffer_item(Buffer* buffer){
-    pthread_mutex_lock(&buffer->mutex);
-    while (buffer->items_in_buf == 0){
-        pthread_cond_wait(&buffer->full, &buffer->mutex);
+    // Keep going after short writes, e.g. into a full pipe
+    struct iovec* next = iov;
+    while (iovcnt > 0) {
+        ssize_t written = writev(STDOUT_FILENO, next, iovcnt);
+        if (written < 0) {
+            perror("writev");
+            exit(1);
+        }
+        while (iovcnt > 0 && (size_t)written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (char*)next->iov_base + written;
+            next->iov_len -= written;
+        }
     }
-    char* line = buffer->lines[buffer->consumer_index];
-    buffer->consumer_index = (buffer->consumer_index + 1) % MAX_LINES;
-    buffer->items_in_buf--;
-    pthread_mutex_unlock(&buffer->mutex);
-    return line;
+
+    out->first = end % OUTPUT_LINES;
+    out->complete = 0;
 }
 
-// Read a line of input from the user
-char* get_line(){
-    size_t size = 0;
-    char* input = NULL;
+// Only the staged lines are kept, never the whole input
+Output out;
 
-    // Read a line of input from stdin using getline
-    if (getline(&input, &size, stdin) == -1) {
-        fprintf(stderr, "Failed to read input\n");
-        return NULL;
+// Add text to the output, writing it out whenever all the slots are full.
+void output_text(const char* text, size_t length){
+    while (length > 0) {
+        char* output_line = out.lines[(out.first + out.complete) % OUTPUT_LINES];
+        size_t n = MAX_OUTPUT_LENGTH - out.filled;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(output_line + out.filled, text, n);
+        out.filled += n;
+        text += n;
+        length -= n;
+
+        if (out.filled == MAX_OUTPUT_LENGTH) {
+            output_line[MAX_OUTPUT_LENGTH] = '\n';
+            out.filled = 0;
+            // The next line needs a free slot
+            if (++out.complete == OUTPUT_LINES) {
+                flush_output(&out);
+            }
+        }
     }
-    return input;
 }
 
-/* Thread 1, called the Input Thread, reads in lines of 
- * characters from the standard input. */
-void* input_thread(void* args) {
-    int i = 0;
-
-    for (;;) {
-        char* line_temp_input = get_line();
+/* Stage 4, called the Output Stage, write this processed
+ * data to standard output as lines of exactly 80 characters. */
+bool write_output(void* state, Line* line){
+    output_text(line->text, line->length);
+    return true;
+}
 
-        // Check if the input line is "STOP\n"
-        if (!strcmp(line_temp_input, "STOP\n")) {
-            put_buffer(&buffer1, line_temp_input);
-            break;
-        }
+// Don't sit on finished lines while the pipeline has nothing for us
+void flush_output_stage(void* state){
+    flush_output(&out);
+}
 
-        // Put the input line into buffer1
-        put_buffer(&buffer1, line_temp_input);
+/* With -w the stages are not threads of their own. The input is read in
+ * chunks of whole pieces, any worker applies both transforms to a chunk, and
+ * the chunks are written out in the order they were read. A chunk lives in
+ * slot seq % CHUNK_SLOTS from being read until it is written, so the slots
+ * double as the reorder buffer. Chunks end where pieces do, so no "++" is
+ * ever split between two of them. */
+enum { CHUNK_FREE, CHUNK_READ, CHUNK_WORKING, CHUNK_DONE };
 
-        if (++i >= MAX_LINES) {
-            break;
-        }
+typedef struct {
+    size_t seq;
+    int state;
+    bool last;        // Nothing follows this chunk
+    size_t length;
+    char text[CHUNK_SIZE];
+} Chunk;
+
+Chunk chunks[CHUNK_SLOTS];
+pthread_mutex_t chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t chunk_cond = PTHREAD_COND_INITIALIZER;
+// Next chunk a worker will take, and whether the last one has been taken
+size_t next_chunk = 0;
+bool chunks_taken = false;
+
+// Wait until chunk seq has reached state.
+Chunk* wait_chunk(size_t seq, int state){
+    Chunk* chunk = &chunks[seq % CHUNK_SLOTS];
+    pthread_mutex_lock(&chunk_mutex);
+    while (chunk->seq != seq || chunk->state != state) {
+        pthread_cond_wait(&chunk_cond, &chunk_mutex);
     }
+    pthread_mutex_unlock(&chunk_mutex);
+    return chunk;
+}
 
-    return NULL;
+// Move chunk on to state and wake whoever is waiting for that.
+void set_chunk(Chunk* chunk, size_t seq, int state){
+    pthread_mutex_lock(&chunk_mutex);
+    chunk->seq = seq;
+    chunk->state = state;
+    pthread_cond_broadcast(&chunk_cond);
+    pthread_mutex_unlock(&chunk_mutex);
 }
 
-/* Thread 2, called the Line Separator Thread, replaces
- * every line separator in the input by a space. */
-void* line_separator_thread(void* args){
-    char* line;
-    bool stop_flag = false;
-    while (!stop_flag) {
-        line = get_buffer_item(&buffer1);
-        if (!strcmp(line, "STOP\n")) {
-            stop_flag = true;
-            put_buffer(&buffer2, line);
-        } else {
-            for (int j = 0; j < strlen(line); j++){
-                if (line[j] == '\n'){
-                    line[j] = ' ';
-                }
+/* Reads the input into chunks. A chunk is passed on when it is full, or
+ * early when no more input arrives within flush_timeout. */
+void* chunk_input_thread(void* args){
+    for (size_t seq = 0;; seq++) {
+        // The slot is free once the chunk CHUNK_SLOTS before this was written
+        Chunk* chunk = seq < CHUNK_SLOTS ? &chunks[seq] : wait_chunk(seq - CHUNK_SLOTS, CHUNK_FREE);
+
+        chunk->length = 0;
+        chunk->last = false;
+        while (CHUNK_SIZE - chunk->length >= MAX_LENGTH) {
+            char* text;
+            size_t length;
+            if (chunk->length > 0 && !input_ready(flush_timeout)) {
+                break;
+            }
+            if (!read_piece(&text, &length)) {
+                chunk->last = true;
+                break;
             }
-            put_buffer(&buffer2, line);
+            memcpy(chunk->text + chunk->length, text, length);
+            chunk->length += length;
+        }
+        set_chunk(chunk, seq, CHUNK_READ);
+        if (chunk->last) {
+            return NULL;
         }
     }
-    return NULL;
 }
 
-/* Thread, 3 called the Plus Sign thread, replaces every
- * pair of plus signs, i.e., "++", by a "^". */
-void* plus_sign_thread(void* args){
-    char* line;
-    for (int i = 0; i < MAX_LINES; i++){
-        line = get_buffer_item(&buffer2);
-        if (!strcmp(line, "STOP\n")){
-            put_buffer(&buffer3, line);
+// Takes the next chunk that has been read and runs both transforms on it.
+void* worker_thread(void* args){
+    for (;;) {
+        pthread_mutex_lock(&chunk_mutex);
+        Chunk* chunk = &chunks[next_chunk % CHUNK_SLOTS];
+        while (!chunks_taken && (chunk->seq != next_chunk || chunk->state != CHUNK_READ)) {
+            pthread_cond_wait(&chunk_cond, &chunk_mutex);
+            chunk = &chunks[next_chunk % CHUNK_SLOTS];
+        }
+        if (chunks_taken) {
+            pthread_mutex_unlock(&chunk_mutex);
             return NULL;
         }
-        for (int j = 0; j < strlen(line); j++){
-            if (line[j] == '\n'){
-                line[j] = ' ';
-            }
-            if (line[j] == '+' && line[j+1] == '+'){
-                line[j] = '^';
-                memmove(line + j + 1, line + j + 2, strlen(line) - j + 1);
-            }
+        size_t seq = next_chunk++;
+        chunk->state = CHUNK_WORKING;
+        if (chunk->last) {
+            // Let the other workers go
+            chunks_taken = true;
+            pthread_cond_broadcast(&chunk_cond);
         }
-        // Put the input line into buffer3
-        put_buffer(&buffer3, line);
+        pthread_mutex_unlock(&chunk_mutex);
+
+        replace_separators(chunk->text, chunk->length);
+        chunk->length = replace_plus_pairs(chunk->text, chunk->length);
+        set_chunk(chunk, seq, CHUNK_DONE);
     }
-    return NULL;
 }
 
-/* Thread 4, called the Output Thread, write this processed
- * data to standard output as lines of exactly 80 characters. */
-void* output_thread(void* args){
-    char output_line[MAX_OUTPUT_LENGTH + 2]; 
-    int counter = 0;
-    int current_index = 0;
-
-    for (int i = 0; i < MAX_LINES; i++){
-        char* temp = get_buffer_item(&buffer3);
-        counter += strlen(temp);
-
-        if (strcmp(temp, "STOP\n") == 0) {
-          return NULL;
+// Writes the chunks out in order, as lines of exactly 80 characters.
+void* chunk_output_thread(void* args){
+    for (size_t seq = 0;; seq++) {
+        Chunk* chunk = &chunks[seq % CHUNK_SLOTS];
+
+        // Don't sit on finished lines while the next chunk is not ready
+        pthread_mutex_lock(&chunk_mutex);
+        bool ready = chunk->seq == seq && chunk->state == CHUNK_DONE;
+        pthread_mutex_unlock(&chunk_mutex);
+        if (!ready) {
+            flush_output(&out);
+            wait_chunk(seq, CHUNK_DONE);
         }
 
-        strcat(output_buffer, temp);
-
-        if (counter > (MAX_OUTPUT_LENGTH - 1)) {
-          size_t output_length = MAX_OUTPUT_LENGTH;
-          int num_iterations = counter / MAX_OUTPUT_LENGTH;
-          int i;
+        output_text(chunk->text, chunk->length);
+        bool last = chunk->last;
+        // Hand the slot back to the input for chunk seq + CHUNK_SLOTS
+        set_chunk(chunk, seq, CHUNK_FREE);
+        if (last) {
+            flush_output(&out);
+            return NULL;
+        }
+    }
+}
 
-          for (i = 0; i < num_iterations; i++) {
-            strncpy(output_line, output_buffer + current_index, output_length);
-            output_line[output_length] = '\n';
-            output_line[output_length + 1] = '\0';
-            write(STDOUT_FILENO, output_line, output_length + 1);
-            current_index += output_length;
-            counter -= output_length;
-          }
+// Prints the statistics each time SIGUSR1 arrives.
+void* stats_thread(void* args){
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    for (;;) {
+        int sig;
+        if (sigwait(&signals, &sig) == 0) {
+            pipeline_print_stats(&pipeline, stderr, stats_json);
         }
     }
     return NULL;
 }
 
-int main(){
-    // Initialize the buffers
-    init_buffer(&buffer1);
-    init_buffer(&buffer2);
-    init_buffer(&buffer3);
-
-    pthread_t input_tid, line_separator_tid, plus_sign_tid, output_tid;
-    // Create the threads
-    pthread_create(&input_tid, NULL, input_thread, NULL);
-    pthread_create(&line_separator_tid, NULL, line_separator_thread, NULL);
-    pthread_create(&plus_sign_tid, NULL, plus_sign_thread, NULL);
-    pthread_create(&output_tid, NULL, output_thread, NULL);
-    
-    // Wait for the threads to finish
+// The CPU for the index-th thread, or -1 if it may run anywhere.
+int thread_cpu(int index){
+    return ncpus > 0 ? thread_cpus[index % ncpus] : -1;
+}
+
+// Start a thread, pinned to the CPU for the index-th thread.
+void start_thread(pthread_t* tid, void* (*run)(void*), int index){
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pipeline_set_cpu(&attr, thread_cpu(index));
+    pthread_create(tid, &attr, run, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+/* Runs the pipeline as a pool of workers instead of a thread per stage. The
+ * input thread, the workers and the output thread take the CPUs in that
+ * order. Chunks are touched by all of them, so they stay where they are. */
+void run_workers(){
+    pthread_t input_tid, output_tid, worker_tids[MAX_WORKERS];
+
+    start_thread(&input_tid, chunk_input_thread, 0);
+    for (int i = 0; i < workers; i++) {
+        start_thread(&worker_tids[i], worker_thread, i + 1);
+    }
+    start_thread(&output_tid, chunk_output_thread, workers + 1);
+
     pthread_join(input_tid, NULL);
-    pthread_join(line_separator_tid, NULL);
-    pthread_join(plus_sign_tid, NULL);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(worker_tids[i], NULL);
+    }
     pthread_join(output_tid, NULL);
+}
+
+int main(int argc, char* argv[]){
+    int opt;
+    // Set by the options that only the thread-per-stage pipeline uses
+    bool pipeline_options = false;
+    input_init(&input, read_stdin, NULL);
+    while ((opt = getopt(argc, argv, "sb:t:w:fS:W:c:")) != -1) {
+        switch (opt) {
+        case 's':
+            max_lines = 0;
+            break;
+        case 'b':
+            pipeline_options = true;
+            batch_size = atoi(optarg);
+            if (batch_size < 1 || batch_size > RING_SIZE) {
+                fprintf(stderr, "%s: batch size must be from 1 to %d\n", argv[0], RING_SIZE);
+                return 1;
+            }
+            break;
+        case 't':
+            flush_timeout = atoi(optarg);
+            if (flush_timeout < 0) {
+                fprintf(stderr, "%s: flush timeout must not be negative\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            if (workers < 1 || workers > MAX_WORKERS) {
+                fprintf(stderr, "%s: workers must be from 1 to %d\n", argv[0], MAX_WORKERS);
+                return 1;
+            }
+            break;
+        case 'f':
+            pipeline_options = true;
+            fuse = true;
+            break;
+        case 'S':
+            pipeline_options = true;
+            stats_at_exit = true;
+            if (!strcmp(optarg, "json")) {
+                stats_json = true;
+            } else if (strcmp(optarg, "text")) {
+                fprintf(stderr, "%s: statistics format must be text or json\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'W':
+            pipeline_options = true;
+            if (!strcmp(optarg, "cond")) {
+                wait_policy = PIPELINE_WAIT_CONDVAR;
+            } else if (!strcmp(optarg, "spin")) {
+                wait_policy = PIPELINE_WAIT_SPIN;
+            } else if (!strcmp(optarg, "park")) {
+                wait_policy = PIPELINE_WAIT_PARK;
+            } else {
+                fprintf(stderr, "%s: wait policy must be cond, spin or park\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (!strcmp(optarg, "auto")) {
+                place_auto = true;
+                break;
+            }
+            for (char* cpu = strtok(optarg, ","); cpu != NULL; cpu = strtok(NULL, ",")) {
+                char* end;
+                errno = 0;
+                long number = strtol(cpu, &end, 10);
+                if (ncpus == MAX_WORKERS + 2 || end == cpu || *end != '\0' || errno != 0 ||
+                    number < 0 || number >= sysconf(_SC_NPROCESSORS_CONF)) {
+                    fprintf(stderr, "%s: CPUs must be auto or up to %d CPU numbers below %ld\n", argv[0],
+                            MAX_WORKERS + 2, sysconf(_SC_NPROCESSORS_CONF));
+                    return 1;
+                }
+                thread_cpus[ncpus++] = number;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s] [-f] [-b LINES] [-t MS] [-S text|json] [-W cond|spin|park]\n"
+                            "       [-c auto|CPU,...]\n"
+                            "       %s [-s] [-t MS] -w WORKERS [-c auto|CPU,...]\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
 
-    // Destroy the buffers
-    destroy_buffer(&buffer1);
-    destroy_buffer(&buffer2);
-    destroy_buffer(&buffer3);
+    if (workers > 0) {
+        // The workers have no rings to wait on and gather no statistics
+        if (pipeline_options) {
+            fprintf(stderr, "%s: -b, -f, -S and -W cannot be used with -w\n", argv[0]);
+            return 1;
+        }
+        // Nothing to print on SIGUSR1, but it must not kill us either
+        signal(SIGUSR1, SIG_IGN);
+        if (place_auto && pipeline_place(thread_cpus, workers + 2) == 0) {
+            ncpus = workers + 2;
+        }
+        run_workers();
+        return 0;
+    }
 
-    return 0;
-} 
+    Stage input = { .name = "input", .read = read_input, .ready = input_waiting };
+    Stage line_separator = { .name = "line_separator", .process = separate_lines };
+    Stage plus_sign = { .name = "plus_sign", .process = replace_plus_signs };
+    Stage output = { .name = "output", .process = write_output,
+                     .idle = flush_output_stage, .finish = flush_output_stage };
+
+    pipeline_init(&pipeline, batch_size, flush_timeout);
+    pipeline.wait_policy = wait_policy;
+    pipeline_add(&pipeline, input, PIPELINE_NEW_THREAD);
+    pipeline_add(&pipeline, line_separator, PIPELINE_NEW_THREAD);
+    pipeline_add(&pipeline, plus_sign, fuse ? PIPELINE_FUSE : PIPELINE_NEW_THREAD);
+    pipeline_add(&pipeline, output, PIPELINE_NEW_THREAD);
+    if (place_auto && pipeline_place(thread_cpus, pipeline.nthreads) == 0) {
+        ncpus = pipeline.nthreads;
+    }
+    for (int i = 0; i < pipeline.nthreads; i++) {
+        pipeline.cpus[i] = thread_cpu(i);
+    }
+
+    // Only stats_thread takes SIGUSR1; the others inherit the mask from here
+    sigset_t signals;
+    pthread_t stats_tid;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_create(&stats_tid, NULL, stats_thread, NULL);
 
+    if (pipeline_run(&pipeline) != 0) {
+        return 1;
+    }
+    if (stats_at_exit) {
+        pipeline_print_stats(&pipeline, stderr, stats_json);
+    }
+    return 0;
+}
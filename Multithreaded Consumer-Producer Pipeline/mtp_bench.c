@@ -0,0 +1,425 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "text.h"
+
+/* Benchmarks mtp's stages in-process on generated input, and checks what
+ * comes out against a plain single-threaded version of the same transform.
+ * The input stage, the two transforms and the rings are mtp's own; only
+ * standard input and output are replaced. Workloads:
+ *
+ *   short   lines of up to 40 characters
+ *   long    lines of 1000 to 8000 characters, passed along in pieces
+ *   plus    lines mostly of '+', so nearly every character is rewritten
+ *   bursty  short lines arriving 256 at a time, a millisecond apart, so
+ *           partial batches are flushed and threads keep going to sleep;
+ *           paced like this it gets 1/64 of the bytes of the others
+ *   stream  lines of up to 400 characters, several GB of them (-g)
+ *
+ * Every workload runs with each wait policy. Results are CSV on stdout:
+ *
+ *   workload,policy,bytes,lines,seconds,mb_per_s,lines_per_s,p50_ns,p99_ns,p999_ns,
+ *   input_cpu_ms,separator_cpu_ms,plus_cpu_ms,output_cpu_ms,check
+ *
+ * Latencies are from the pipeline's histogram, so they are powers of two.
+ * check is "ok" when the output matched the reference, and the exit status
+ * is 1 if any run did not. SPIN is skipped when there are more threads than
+ * CPUs, where it would mostly measure the scheduler.
+ */
+
+#ifdef PIPELINE_NO_STATS
+#error mtp_bench needs the pipeline statistics
+#endif
+
+#define MAX_OUTPUT_LENGTH 80
+
+// Generated lines are copied from random places in this much random text,
+// wrapping around at the end
+#define PATTERN_SIZE 65536
+#define MAX_COPY 8192
+
+#define THREADS 4
+
+static const char* policy_names[] = { "cond", "spin", "park" };
+
+typedef struct {
+    const char* name;
+    // Line lengths, not counting the newline
+    int min_length;
+    int max_length;
+    // Characters to draw from; repeat one to make it more likely
+    const char* alphabet;
+    // Lines per burst and the time between bursts, or 0 to send them all
+    int burst_lines;
+    long burst_gap_ns;
+    // Runs on -n MB shifted right by this, as bursts take a while to send
+    int size_shift;
+} Workload;
+
+static const Workload workloads[] = {
+    { "short", 0, 40, "abcdefghij +", 0, 0, 0 },
+    { "long", 1000, 8000, "abcdefghij +", 0, 0, 0 },
+    { "plus", 40, 120, "+++++++++a ", 0, 0, 0 },
+    { "bursty", 0, 40, "abcdefghij +", 256, 1000000, 6 },
+    { "stream", 0, 400, "abcdefghij +", 0, 0, 0 },
+};
+
+#define NWORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+// Makes the same input every time for the same workload and seed.
+typedef struct {
+    const Workload* workload;
+    uint64_t rng;
+    long long remaining;    // Bytes still to generate
+    long long lines;        // Lines started so far
+    int line_left;          // Of the current line, counting its newline
+    size_t pattern_at;      // Where the current line goes on from in pattern
+    // With bursts: lines left in this one and when the next one is due. The
+    // reference leaves timed off and takes every burst straight away.
+    bool timed;
+    int burst_left;
+    uint64_t next_burst;
+    char pattern[PATTERN_SIZE + MAX_COPY];
+} Generator;
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64
+static uint64_t next_random(Generator* generator){
+    generator->rng ^= generator->rng << 13;
+    generator->rng ^= generator->rng >> 7;
+    generator->rng ^= generator->rng << 17;
+    return generator->rng;
+}
+
+static void generator_init(Generator* generator, const Workload* workload, long long bytes, uint64_t seed,
+                           bool timed){
+    size_t letters = strlen(workload->alphabet);
+    generator->workload = workload;
+    generator->rng = seed * 2654435761ULL + 1;
+    generator->remaining = bytes;
+    generator->lines = 0;
+    generator->line_left = 0;
+    generator->timed = timed && workload->burst_lines > 0;
+    generator->burst_left = 0;
+    generator->next_burst = now_ns();
+    for (size_t i = 0; i < PATTERN_SIZE; i++) {
+        generator->pattern[i] = workload->alphabet[next_random(generator) % letters];
+    }
+    // So that MAX_COPY can be copied from anywhere without wrapping
+    memcpy(generator->pattern + PATTERN_SIZE, generator->pattern, MAX_COPY);
+}
+
+// True if the next line may be generated now, starting a burst if one is due.
+static bool line_due(Generator* generator){
+    if (!generator->timed || generator->burst_left > 0) {
+        return true;
+    }
+    if (now_ns() < generator->next_burst) {
+        return false;
+    }
+    generator->burst_left = generator->workload->burst_lines;
+    generator->next_burst += generator->workload->burst_gap_ns;
+    return true;
+}
+
+/* Generate up to size bytes of input without waiting. Returns fewer, or
+ * none, at the end of the input or of a burst. The input is the same however
+ * it is divided up between calls. */
+static size_t generate(Generator* generator, char* buffer, size_t size){
+    const Workload* workload = generator->workload;
+    size_t n = 0;
+
+    while (n < size && generator->remaining > 0) {
+        if (generator->line_left == 0) {
+            if (!line_due(generator)) {
+                break;
+            }
+            generator->line_left = workload->min_length + 1 +
+                next_random(generator) % (workload->max_length - workload->min_length + 1);
+            generator->pattern_at = next_random(generator) % PATTERN_SIZE;
+            generator->lines++;
+            if (generator->timed) {
+                generator->burst_left--;
+            }
+        }
+        if (generator->line_left == 1) {
+            buffer[n++] = '\n';
+            generator->line_left = 0;
+            generator->remaining--;
+            continue;
+        }
+        size_t take = generator->line_left - 1;
+        if (take > size - n) {
+            take = size - n;
+        }
+        if ((long long)take > generator->remaining) {
+            take = generator->remaining;
+        }
+        if (take > MAX_COPY) {
+            take = MAX_COPY;
+        }
+        memcpy(buffer + n, generator->pattern + generator->pattern_at, take);
+        generator->pattern_at = (generator->pattern_at + take) % PATTERN_SIZE;
+        n += take;
+        generator->line_left -= take;
+        generator->remaining -= take;
+    }
+    return n;
+}
+
+// What came out: a count and a hash of the whole 80-character lines.
+typedef struct {
+    char line[MAX_OUTPUT_LENGTH];
+    size_t length;
+    unsigned long long lines;
+    uint64_t hash;
+} Output;
+
+static void output_init(Output* output){
+    output->length = 0;
+    output->lines = 0;
+    output->hash = 0xcbf29ce484222325ULL;
+}
+
+static void output_text(Output* output, const char* text, size_t length){
+    while (length > 0) {
+        size_t n = MAX_OUTPUT_LENGTH - output->length;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(output->line + output->length, text, n);
+        output->length += n;
+        text += n;
+        length -= n;
+        if (output->length == MAX_OUTPUT_LENGTH) {
+            for (int i = 0; i < MAX_OUTPUT_LENGTH; i += 8) {
+                uint64_t word;
+                memcpy(&word, output->line + i, 8);
+                output->hash = (output->hash ^ word) * 0x100000001b3ULL;
+                output->hash ^= output->hash >> 29;
+            }
+            output->lines++;
+            output->length = 0;
+        }
+    }
+}
+
+/* The reference: the same input, one character at a time on one thread.
+ * Every '\n' becomes a space, and a '+' is held back until the next
+ * character shows whether it makes a pair. */
+static void reference(const Workload* workload, long long bytes, uint64_t seed, Output* output){
+    static Generator generator;
+    static char in[INPUT_SIZE];
+    static char out[INPUT_SIZE + 1];
+    bool plus = false;
+    size_t n;
+
+    generator_init(&generator, workload, bytes, seed, false);
+    output_init(output);
+    while ((n = generate(&generator, in, sizeof(in))) > 0) {
+        size_t length = 0;
+        for (size_t i = 0; i < n; i++) {
+            char c = in[i] == '\n' ? ' ' : in[i];
+            if (c == '+') {
+                if (plus) {
+                    out[length++] = '^';
+                }
+                plus = !plus;
+                continue;
+            }
+            if (plus) {
+                out[length++] = '+';
+                plus = false;
+            }
+            out[length++] = c;
+        }
+        output_text(output, out, length);
+    }
+    if (plus) {
+        output_text(output, "+", 1);
+    }
+}
+
+static Generator generator;
+static Input input;
+static Output output;
+static Pipeline pipeline;
+
+// Input's fill function: generate, waiting for the next burst if need be.
+static ssize_t fill(void* state, char* buffer, size_t size){
+    Generator* generator = state;
+    for (;;) {
+        size_t n = generate(generator, buffer, size);
+        if (n > 0 || generator->remaining == 0) {
+            return n;
+        }
+        struct timespec due = { generator->next_burst / 1000000000, generator->next_burst % 1000000000 };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+    }
+}
+
+static bool read_input(void* state, Line* line){
+    line->length = input_piece(&input, &line->text);
+    return line->length > 0;
+}
+
+// Like poll on standard input: sleep up to timeout for the next burst.
+static bool input_waiting(void* state, int timeout){
+    if (input_buffered(&input) || generator.remaining == 0 || generator.line_left > 0 ||
+        line_due(&generator)) {
+        return true;
+    }
+    uint64_t wait = generator.next_burst - now_ns();
+    if (wait > (uint64_t)timeout * 1000000) {
+        wait = (uint64_t)timeout * 1000000;
+    }
+    struct timespec pause = { wait / 1000000000, wait % 1000000000 };
+    nanosleep(&pause, NULL);
+    return line_due(&generator);
+}
+
+static bool separate_lines(void* state, Line* line){
+    replace_separators(line->text, line->length);
+    return true;
+}
+
+static bool replace_plus_signs(void* state, Line* line){
+    line->length = replace_plus_pairs(line->text, line->length);
+    return true;
+}
+
+static bool write_output(void* state, Line* line){
+    output_text(&output, line->text, line->length);
+    return true;
+}
+
+static bool run(int policy, const Workload* workload, long long bytes, int batch_size, int flush_timeout,
+                uint64_t seed){
+    Stage stages[THREADS] = {
+        { .name = "input", .read = read_input, .ready = input_waiting },
+        { .name = "line_separator", .process = separate_lines },
+        { .name = "plus_sign", .process = replace_plus_signs },
+        { .name = "output", .process = write_output },
+    };
+    Output expected;
+
+    generator_init(&generator, workload, bytes, seed, true);
+    input_init(&input, fill, &generator);
+    output_init(&output);
+    pipeline_init(&pipeline, batch_size, flush_timeout);
+    pipeline.wait_policy = policy;
+    for (int i = 0; i < THREADS; i++) {
+        pipeline_add(&pipeline, stages[i], PIPELINE_NEW_THREAD);
+    }
+
+    uint64_t start = now_ns();
+    pipeline_run(&pipeline);
+    double seconds = (now_ns() - start) * 1e-9;
+
+    reference(workload, bytes, seed, &expected);
+    bool match = output.lines == expected.lines && output.hash == expected.hash;
+
+    printf("%s,%s,%lld,%lld,%.3f,%.1f,%.0f,%llu,%llu,%llu", workload->name, policy_names[policy], bytes,
+           generator.lines, seconds, bytes / seconds / 1e6, generator.lines / seconds,
+           pipeline_latency(&pipeline, 0.5), pipeline_latency(&pipeline, 0.99),
+           pipeline_latency(&pipeline, 0.999));
+    for (int i = 0; i < THREADS; i++) {
+        printf(",%.1f", atomic_load(&pipeline.thread_stats[i].cpu_ns) / 1e6);
+    }
+    printf(",%s\n", match ? "ok" : "MISMATCH");
+    fflush(stdout);
+    return match;
+}
+
+int main(int argc, char* argv[]){
+    long long megabytes = 256;
+    long long gigabytes = 2;
+    int batch_size = 16;
+    int flush_timeout = 1;
+    int policy = -1;
+    const char* only = NULL;
+    uint64_t seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:g:b:t:W:w:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            megabytes = atoll(optarg);
+            break;
+        case 'g':
+            gigabytes = atoll(optarg);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            break;
+        case 't':
+            flush_timeout = atoi(optarg);
+            break;
+        case 'W':
+            for (int i = PIPELINE_WAIT_CONDVAR; i <= PIPELINE_WAIT_PARK; i++) {
+                if (!strcmp(optarg, policy_names[i])) {
+                    policy = i;
+                }
+            }
+            if (policy < 0) {
+                fprintf(stderr, "%s: wait policy must be cond, spin or park\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n MB] [-g STREAM_GB] [-b BATCH] [-t MS] [-W cond|spin|park]\n"
+                            "       [-w WORKLOAD] [-r SEED]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (megabytes < 1 || gigabytes < 1 || batch_size < 1 || batch_size > RING_SIZE || flush_timeout < 0) {
+        fprintf(stderr, "%s: option out of range\n", argv[0]);
+        return 1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bool all_match = true;
+    bool found = false;
+    printf("workload,policy,bytes,lines,seconds,mb_per_s,lines_per_s,p50_ns,p99_ns,p999_ns,"
+           "input_cpu_ms,separator_cpu_ms,plus_cpu_ms,output_cpu_ms,check\n");
+    for (int i = 0; i < NWORKLOADS; i++) {
+        const Workload* workload = &workloads[i];
+        long long bytes = !strcmp(workload->name, "stream") ? gigabytes << 30 : megabytes << 20 >> workload->size_shift;
+        if (only != NULL && strcmp(only, workload->name)) {
+            continue;
+        }
+        found = true;
+        for (int p = PIPELINE_WAIT_CONDVAR; p <= PIPELINE_WAIT_PARK; p++) {
+            if (policy >= 0 && p != policy) {
+                continue;
+            }
+            if (p == PIPELINE_WAIT_SPIN && THREADS > cpus) {
+                fprintf(stderr, "skipping spin: %d threads but %ld CPUs\n", THREADS, cpus);
+                continue;
+            }
+            all_match &= run(p, workload, bytes, batch_size, flush_timeout, seed);
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "%s: no workload called %s\n", argv[0], only);
+        return 1;
+    }
+    return all_match ? 0 : 1;
+}
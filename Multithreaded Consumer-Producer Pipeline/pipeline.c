@@ -0,0 +1,670 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+
+// Times PIPELINE_WAIT_PARK checks a ring before going to sleep on it
+#define SPIN_LIMIT 1000
+
+#ifndef PIPELINE_NO_STATS
+#define STAT(statement) statement
+
+// The thread each pipeline thread is running, for the ring functions
+static _Thread_local PipelineThread* current;
+
+static uint64_t clock_ns(clockid_t clock){
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_ns(){
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+// Counters have a single writer, so a plain load and store will do.
+static void stat_add(atomic_ullong* counter, unsigned long long n){
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static void stat_max(atomic_ullong* counter, unsigned long long n){
+    if (n > atomic_load_explicit(counter, memory_order_relaxed)) {
+        atomic_store_explicit(counter, n, memory_order_relaxed);
+    }
+}
+
+static ThreadStats* current_stats(){
+    return current != NULL ? &current->pipeline->thread_stats[current->index] : NULL;
+}
+#else
+#define STAT(statement)
+#endif
+
+// Initialize a ring
+static void init_ring(Ring* ring, int wait_policy){
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->head_cache = 0;
+    ring->tail_cache = 0;
+    atomic_init(&ring->sleepers, 0);
+    ring->wait_policy = wait_policy;
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+    atomic_init(&ring->futex, 0);
+}
+
+// Destroy a ring and release associated resources.
+static void destroy_ring(Ring* ring){
+    pthread_mutex_destroy(&ring->mutex);
+    pthread_cond_destroy(&ring->cond);
+}
+
+// Let a spinning hyperthread's sibling have the core for a moment.
+static void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+// Sleep until *index no longer equals seen, the way the ring's policy says.
+static void ring_wait(Ring* ring, atomic_size_t* index, size_t seen){
+    STAT(uint64_t start = now_ns();)
+    switch (ring->wait_policy) {
+    case PIPELINE_WAIT_SPIN:
+        while (atomic_load_explicit(index, memory_order_acquire) == seen) {
+            cpu_relax();
+        }
+        break;
+
+    case PIPELINE_WAIT_PARK:
+        for (int i = 0; i < SPIN_LIMIT; i++) {
+            if (atomic_load_explicit(index, memory_order_acquire) != seen) {
+                break;
+            }
+            cpu_relax();
+        }
+        // As with the condvar below, either ring_wake sees us sleeping and
+        // bumps futex, making FUTEX_WAIT return at once, or we see the update.
+        atomic_fetch_add(&ring->sleepers, 1);
+        for (;;) {
+            unsigned word = atomic_load(&ring->futex);
+            if (atomic_load(index) != seen) {
+                break;
+            }
+            syscall(SYS_futex, &ring->futex, FUTEX_WAIT_PRIVATE, word, NULL, NULL, 0);
+        }
+        atomic_fetch_sub(&ring->sleepers, 1);
+        break;
+
+    default:
+        pthread_mutex_lock(&ring->mutex);
+        // The seq_cst increment pairs with the fence in ring_wake: either the
+        // other side sees us sleeping, or we see its update here.
+        atomic_fetch_add(&ring->sleepers, 1);
+        while (atomic_load(index) == seen) {
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+        }
+        atomic_fetch_sub(&ring->sleepers, 1);
+        pthread_mutex_unlock(&ring->mutex);
+        break;
+    }
+
+    // Only an empty input ring means waiting for work. An empty free ring
+    // means every line is still somewhere downstream.
+    STAT(ThreadStats* stats = current_stats();)
+    STAT(if (stats != NULL) {
+        bool empty = index == &ring->tail && ring == current->in;
+        stat_add(empty ? &stats->empty_ns : &stats->full_ns, now_ns() - start);
+    })
+}
+
+// Wake the other side if it went to sleep on this ring.
+static void ring_wake(Ring* ring){
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->sleepers, memory_order_relaxed) > 0) {
+        if (ring->wait_policy == PIPELINE_WAIT_PARK) {
+            atomic_fetch_add(&ring->futex, 1);
+            syscall(SYS_futex, &ring->futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        } else {
+            pthread_mutex_lock(&ring->mutex);
+            pthread_cond_broadcast(&ring->cond);
+            pthread_mutex_unlock(&ring->mutex);
+        }
+    }
+}
+
+/* Put n lines into the ring at once, blocking only while there is no room
+ * for all of them. The consumer is told about the whole batch with a single
+ * store. */
+static void ring_put_batch(Ring* ring, Line** lines, size_t n) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (RING_SIZE - (tail - ring->head_cache) < n) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (RING_SIZE - (tail - ring->head_cache) < n) {
+            ring_wait(ring, &ring->head, ring->head_cache);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        ring->lines[(tail + i) & (RING_SIZE - 1)] = lines[i];
+    }
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+    ring_wake(ring);
+}
+
+/* Take up to max of the oldest lines out of the ring, blocking only while it
+ * is empty. Returns how many were taken. */
+static size_t ring_get_batch(Ring* ring, Line** lines, size_t max){
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (head == ring->tail_cache) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head == ring->tail_cache) {
+            ring_wait(ring, &ring->tail, head);
+        }
+    }
+    // Pick up anything added since tail was last looked at
+    if (ring->tail_cache - head < max) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    }
+    size_t n = ring->tail_cache - head;
+    STAT(if (current != NULL && ring == current->in) {
+        ThreadStats* stats = current_stats();
+        stat_add(&stats->gets, 1);
+        stat_add(&stats->occupancy_sum, n);
+        stat_max(&stats->occupancy_max, n);
+    })
+    if (n > max) {
+        n = max;
+    }
+    for (size_t i = 0; i < n; i++) {
+        lines[i] = ring->lines[(head + i) & (RING_SIZE - 1)];
+    }
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+    ring_wake(ring);
+    return n;
+}
+
+// Put a single line into the ring.
+static void ring_put(Ring* ring, Line* line) {
+    ring_put_batch(ring, &line, 1);
+}
+
+// Take the oldest line out of the ring.
+static Line* ring_get(Ring* ring){
+    Line* line;
+    ring_get_batch(ring, &line, 1);
+    return line;
+}
+
+/* True if the consumer would have to wait for the next line. Only the
+ * consumer may ask. */
+static bool ring_empty(Ring* ring){
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head != ring->tail_cache) {
+        return false;
+    }
+    ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return head == ring->tail_cache;
+}
+
+#ifndef PIPELINE_NO_STATS
+// Histogram bucket for a latency: the position of its highest set bit.
+static int latency_bucket(uint64_t ns){
+    int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+#endif
+
+// Let the stages of a thread know it is about to wait.
+static void idle_stages(Stage* stages, int count){
+    for (int i = 0; i < count; i++) {
+        if (stages[i].idle != NULL) {
+            stages[i].idle(stages[i].state);
+        }
+    }
+}
+
+/* Read up to batch_size lines with the first stage. The batch goes out early
+ * if the stage says more input is not coming within flush_timeout. Sets *end
+ * once the input is over. */
+static size_t read_batch(PipelineThread* thread, Line** batch, bool* end){
+    Pipeline* pipeline = thread->pipeline;
+    Stage* source = &pipeline->stages[0];
+    size_t n = 0;
+    // Every line of a batch counts from when its first line was read
+    STAT(uint64_t start = 0;)
+
+    while (n < (size_t)pipeline->batch_size) {
+        if (source->ready != NULL && !source->ready(source->state, n > 0 ? pipeline->flush_timeout : 0)) {
+            if (n > 0) {
+                break;
+            }
+            idle_stages(pipeline->stages, thread->count);
+        }
+
+        Line* line = ring_get(&pipeline->free_lines);
+        line->dropped = false;
+        line->text = line->buffer;
+        if (!source->read(source->state, line)) {
+            // This line is never needed again, so it need not go back
+            *end = true;
+            break;
+        }
+        STAT(if (n == 0) {
+            start = now_ns();
+        })
+        STAT(line->born = start;)
+        STAT(stat_add(&pipeline->stage_stats[0].lines, 1);)
+        STAT(stat_add(&pipeline->stage_stats[0].bytes, line->length);)
+        batch[n++] = line;
+    }
+    return n;
+}
+
+/* Runs a group of fused stages. Every line goes through all of them before
+ * the batch moves on, and the end of the stream is passed on as a NULL once
+ * every stage has finished. */
+static void* pipeline_thread(void* args){
+    PipelineThread* thread = args;
+    Pipeline* pipeline = thread->pipeline;
+    Stage* stages = &pipeline->stages[thread->first];
+    // The first stage read the lines rather than process them
+    int skip = thread->in == NULL ? 1 : 0;
+    Line* batch[RING_SIZE];
+    bool end = false;
+    STAT(current = thread;)
+
+    while (!end) {
+        size_t n;
+        if (thread->in == NULL) {
+            n = read_batch(thread, batch, &end);
+        } else {
+            if (ring_empty(thread->in)) {
+                idle_stages(stages, thread->count);
+            }
+            n = ring_get_batch(thread->in, batch, pipeline->batch_size);
+            if (batch[n - 1] == NULL) {
+                end = true;
+                n--;
+            }
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            Line* line = batch[i];
+            for (int j = skip; j < thread->count && !line->dropped; j++) {
+                STAT(StageStats* stats = &pipeline->stage_stats[thread->first + j];)
+                STAT(stat_add(&stats->lines, 1);)
+                STAT(stat_add(&stats->bytes, line->length);)
+                if (!stages[j].process(stages[j].state, line)) {
+                    line->dropped = true;
+                    STAT(stat_add(&stats->dropped, 1);)
+                }
+            }
+        }
+
+        // One clock reading does for the whole batch
+        STAT(if (thread->out == NULL && n > 0) {
+            ThreadStats* stats = current_stats();
+            uint64_t now = now_ns();
+            for (size_t i = 0; i < n; i++) {
+                if (!batch[i]->dropped) {
+                    stat_add(&stats->latency[latency_bucket(now - batch[i]->born)], 1);
+                }
+            }
+        })
+
+        // Done with the lines, pass them on or let the first stage reuse them
+        ring_put_batch(thread->out != NULL ? thread->out : &pipeline->free_lines, batch, n);
+    }
+
+    for (int j = 0; j < thread->count; j++) {
+        if (stages[j].finish != NULL) {
+            stages[j].finish(stages[j].state);
+        }
+    }
+    if (thread->out != NULL) {
+        ring_put(thread->out, NULL);
+    }
+    STAT(stat_add(&current_stats()->cpu_ns, clock_ns(CLOCK_THREAD_CPUTIME_ID));)
+    return NULL;
+}
+
+/* Where the threads run. Topology comes from sysfs, and anything missing
+ * from it, such as caches on some virtual machines, counts as unshared. */
+
+// Read the number at the start of a sysfs file, or return fallback.
+static int read_sysfs_int(const char* path, int fallback){
+    FILE* file = fopen(path, "r");
+    int value;
+    if (file == NULL) {
+        return fallback;
+    }
+    if (fscanf(file, "%d", &value) != 1) {
+        value = fallback;
+    }
+    fclose(file);
+    return value;
+}
+
+// The lowest numbered CPU sharing cpu's cache of the given level. The first
+// number of shared_cpu_list is always its lowest.
+static int cache_group(int cpu, int level){
+    char path[128];
+    for (int index = 0;; index++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        int found = read_sysfs_int(path, -1);
+        if (found < 0) {
+            return cpu;
+        }
+        if (found == level) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+                     cpu, index);
+            return read_sysfs_int(path, cpu);
+        }
+    }
+}
+
+// The NUMA node cpu is on, from its nodeN link, or -1 if it has none.
+static int cpu_node(int cpu){
+    char path[64];
+    struct dirent* entry;
+    int node = -1;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+typedef struct {
+    int package;
+    int l3;
+    int l2;
+    int cpu;
+} CpuPlace;
+
+static int compare_places(const void* a, const void* b){
+    const CpuPlace* x = a;
+    const CpuPlace* y = b;
+    if (x->package != y->package) {
+        return x->package - y->package;
+    }
+    if (x->l3 != y->l3) {
+        return x->l3 - y->l3;
+    }
+    if (x->l2 != y->l2) {
+        return x->l2 - y->l2;
+    }
+    return x->cpu - y->cpu;
+}
+
+/* Sorting the CPUs by package, then L3, then L2 puts CPUs that share the
+ * most cache next to each other, so consecutive threads take them in turn. */
+int pipeline_place(int* cpus, int n){
+    static CpuPlace places[CPU_SETSIZE];
+    cpu_set_t allowed;
+    char path[128];
+    int count = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        places[count].package = read_sysfs_int(path, 0);
+        places[count].l3 = cache_group(cpu, 3);
+        places[count].l2 = cache_group(cpu, 2);
+        places[count].cpu = cpu;
+        count++;
+    }
+    if (count == 0) {
+        return -1;
+    }
+    qsort(places, count, sizeof(CpuPlace), compare_places);
+    for (int i = 0; i < n; i++) {
+        cpus[i] = places[i % count].cpu;
+    }
+    return 0;
+}
+
+void pipeline_set_cpu(pthread_attr_t* attr, int cpu){
+    cpu_set_t set;
+    if (cpu < 0) {
+        return;
+    }
+    // A CPU the process may not use would stop the thread being created
+    if (sched_getaffinity(0, sizeof(set), &set) != 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &set)) {
+        fprintf(stderr, "CPU %d is not available, not pinning to it\n", cpu);
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/* Move memory to the NUMA node of cpu, and keep it there, if cpu is pinned
+ * and the system has NUMA. Goes by page, so it must not share pages with
+ * anything else. It is only a preference: failing leaves it where it is. */
+static void move_to_node(void* memory, size_t size, int cpu){
+    int node = cpu < 0 ? -1 : cpu_node(cpu);
+    if (node < 0 || node >= (int)(sizeof(unsigned long) * CHAR_BIT)) {
+        return;
+    }
+    unsigned long nodes = 1UL << node;
+    syscall(SYS_mbind, memory, size, MPOL_PREFERRED, &nodes, sizeof(nodes) * CHAR_BIT + 1, MPOL_MF_MOVE);
+}
+
+void pipeline_init(Pipeline* pipeline, int batch_size, int flush_timeout){
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->batch_size = batch_size;
+    pipeline->flush_timeout = flush_timeout;
+    for (int i = 0; i < MAX_STAGES; i++) {
+        pipeline->cpus[i] = -1;
+    }
+}
+
+int pipeline_add(Pipeline* pipeline, Stage stage, int placement){
+    if (pipeline->nstages == MAX_STAGES) {
+        return -1;
+    }
+    if (pipeline->nstages == 0 || placement == PIPELINE_NEW_THREAD) {
+        PipelineThread* thread = &pipeline->threads[pipeline->nthreads];
+        thread->pipeline = pipeline;
+        thread->index = pipeline->nthreads++;
+        thread->first = pipeline->nstages;
+        thread->count = 0;
+    }
+    pipeline->threads[pipeline->nthreads - 1].count++;
+    pipeline->stages[pipeline->nstages++] = stage;
+    return 0;
+}
+
+int pipeline_run(Pipeline* pipeline){
+    int nstages = pipeline->nstages;
+    int nthreads = pipeline->nthreads;
+
+    for (int i = 0; i < nstages; i++) {
+        Stage* stage = &pipeline->stages[i];
+        if (stage->init != NULL && stage->init(stage->state) != 0) {
+            fprintf(stderr, "Failed to initialize stage %s\n", stage->name);
+            // Undo the ones that did start
+            while (i-- > 0) {
+                if (pipeline->stages[i].teardown != NULL) {
+                    pipeline->stages[i].teardown(pipeline->stages[i].state);
+                }
+            }
+            return -1;
+        }
+    }
+
+    /* Connect the threads, and put every line of the pool on the free ring.
+     * Each ring is moved to the node of the thread that reads it, which
+     * polls it the most, and the free ring is read by the first thread. */
+    for (int i = 0; i < nthreads; i++) {
+        PipelineThread* thread = &pipeline->threads[i];
+        thread->in = i > 0 ? &pipeline->rings[i - 1] : NULL;
+        thread->out = i < nthreads - 1 ? &pipeline->rings[i] : NULL;
+        init_ring(&pipeline->rings[i], pipeline->wait_policy);
+        if (i < nthreads - 1) {
+            move_to_node(&pipeline->rings[i], sizeof(Ring), pipeline->cpus[i + 1]);
+        }
+    }
+    init_ring(&pipeline->free_lines, pipeline->wait_policy);
+    move_to_node(&pipeline->free_lines, sizeof(Ring), pipeline->cpus[0]);
+    for (int i = 0; i < POOL_SIZE; i++) {
+        ring_put(&pipeline->free_lines, &pipeline->pool[i]);
+    }
+
+    // Create the threads
+    for (int i = 0; i < nthreads; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pipeline_set_cpu(&attr, pipeline->cpus[i]);
+        pthread_create(&pipeline->threads[i].tid, &attr, pipeline_thread, &pipeline->threads[i]);
+        pthread_attr_destroy(&attr);
+    }
+    // Wait for the threads to finish
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(pipeline->threads[i].tid, NULL);
+    }
+
+    for (int i = 0; i < nstages; i++) {
+        Stage* stage = &pipeline->stages[i];
+        if (stage->teardown != NULL) {
+            stage->teardown(stage->state);
+        }
+    }
+    for (int i = 0; i < nthreads; i++) {
+        destroy_ring(&pipeline->rings[i]);
+    }
+    destroy_ring(&pipeline->free_lines);
+    return 0;
+}
+
+#ifndef PIPELINE_NO_STATS
+static unsigned long long load(atomic_ullong* counter){
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Copy the latency histogram out of the last thread's counters.
+static unsigned long long load_latency(Pipeline* pipeline, unsigned long long* latency){
+    unsigned long long total = 0;
+    ThreadStats* last = &pipeline->thread_stats[pipeline->nthreads - 1];
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        latency[i] = load(&last->latency[i]);
+        total += latency[i];
+    }
+    return total;
+}
+
+// Upper bound of the bucket that holds the given fraction of the latencies.
+static unsigned long long latency_percentile(unsigned long long* latency, unsigned long long total,
+                                             double fraction){
+    unsigned long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen > 0 && seen >= fraction * total) {
+            return 2ULL << i;
+        }
+    }
+    return 0;
+}
+
+unsigned long long pipeline_latency(Pipeline* pipeline, double fraction){
+    unsigned long long latency[LATENCY_BUCKETS];
+    unsigned long long total = load_latency(pipeline, latency);
+    return latency_percentile(latency, total, fraction);
+}
+
+void pipeline_print_stats(Pipeline* pipeline, FILE* stream, bool json){
+    unsigned long long latency[LATENCY_BUCKETS];
+    unsigned long long total = load_latency(pipeline, latency);
+    unsigned long long p50 = latency_percentile(latency, total, 0.5);
+    unsigned long long p99 = latency_percentile(latency, total, 0.99);
+    unsigned long long p999 = latency_percentile(latency, total, 0.999);
+
+    if (json) {
+        fprintf(stream, "{\"stages\":[");
+        for (int i = 0; i < pipeline->nthreads; i++) {
+            PipelineThread* thread = &pipeline->threads[i];
+            for (int j = thread->first; j < thread->first + thread->count; j++) {
+                StageStats* stats = &pipeline->stage_stats[j];
+                fprintf(stream, "%s{\"name\":\"%s\",\"thread\":%d,\"lines\":%llu,\"bytes\":%llu,\"dropped\":%llu}",
+                        j > 0 ? "," : "", pipeline->stages[j].name, i,
+                        load(&stats->lines), load(&stats->bytes), load(&stats->dropped));
+            }
+        }
+        fprintf(stream, "],\"threads\":[");
+        for (int i = 0; i < pipeline->nthreads; i++) {
+            ThreadStats* stats = &pipeline->thread_stats[i];
+            unsigned long long gets = load(&stats->gets);
+            fprintf(stream, "%s{\"empty_ns\":%llu,\"full_ns\":%llu,\"queue_mean\":%.2f,\"queue_max\":%llu,"
+                    "\"cpu_ns\":%llu}",
+                    i > 0 ? "," : "", load(&stats->empty_ns), load(&stats->full_ns),
+                    gets > 0 ? (double)load(&stats->occupancy_sum) / gets : 0.0,
+                    load(&stats->occupancy_max), load(&stats->cpu_ns));
+        }
+        fprintf(stream, "],\"latency\":{\"lines\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"histogram\":[",
+                total, p50, p99, p999);
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            fprintf(stream, "%s%llu", i > 0 ? "," : "", latency[i]);
+        }
+        fprintf(stream, "]}}\n");
+    } else {
+        fprintf(stream, "%-16s %6s %12s %14s %10s\n", "stage", "thread", "lines", "bytes", "dropped");
+        for (int i = 0; i < pipeline->nthreads; i++) {
+            PipelineThread* thread = &pipeline->threads[i];
+            for (int j = thread->first; j < thread->first + thread->count; j++) {
+                StageStats* stats = &pipeline->stage_stats[j];
+                fprintf(stream, "%-16s %6d %12llu %14llu %10llu\n", pipeline->stages[j].name, i,
+                        load(&stats->lines), load(&stats->bytes), load(&stats->dropped));
+            }
+        }
+        fprintf(stream, "%-6s %14s %14s %10s %9s %10s\n", "thread", "waiting (ms)", "blocked (ms)", "queue avg",
+                "queue max", "cpu (ms)");
+        for (int i = 0; i < pipeline->nthreads; i++) {
+            ThreadStats* stats = &pipeline->thread_stats[i];
+            unsigned long long gets = load(&stats->gets);
+            fprintf(stream, "%-6d %14.3f %14.3f %10.2f %9llu %10.3f\n", i,
+                    load(&stats->empty_ns) / 1e6, load(&stats->full_ns) / 1e6,
+                    gets > 0 ? (double)load(&stats->occupancy_sum) / gets : 0.0,
+                    load(&stats->occupancy_max), load(&stats->cpu_ns) / 1e6);
+        }
+        fprintf(stream, "latency over %llu lines: p50 < %llu ns, p99 < %llu ns, p99.9 < %llu ns\n",
+                total, p50, p99, p999);
+    }
+    fflush(stream);
+}
+#else
+void pipeline_print_stats(Pipeline* pipeline, FILE* stream, bool json){
+}
+
+unsigned long long pipeline_latency(Pipeline* pipeline, double fraction){
+    return 0;
+}
+#endif
@@ -0,0 +1,213 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A pipeline of stages that pass lines along. The first stage reads lines
+ * into buffers from a fixed pool, the others transform them in place, and
+ * after the last stage a line goes back to the pool. Consecutive stages
+ * either share a thread or run on threads of their own, connected by
+ * lock-free single-producer/single-consumer rings. */
+
+// Size of a line's buffer. Longer lines are passed along in pieces this big.
+#define MAX_LENGTH 1001
+
+// Slots per ring. A power of two so the index wraps with a mask.
+#define RING_SIZE 64
+
+// Lines in circulation. Every ring can hold all of them, so only running
+// out of free lines ever makes the first stage wait.
+#define POOL_SIZE RING_SIZE
+
+// Keeps the producer's and consumer's indices on separate cache lines.
+#define CACHE_LINE 64
+
+// Most stages a pipeline can have
+#define MAX_STAGES 16
+
+// Every ring starts a page of its own, so that it can be moved to the NUMA
+// node of the thread that reads from it without taking anything else along.
+#define RING_ALIGN 4096
+
+/* How a thread waits on an empty or full ring. SPIN never sleeps, so it has
+ * the lowest latency but needs a core per thread. PARK spins briefly and
+ * then sleeps on a futex. CONDVAR sleeps on the ring's condition variable
+ * straight away, using the least CPU. */
+enum { PIPELINE_WAIT_CONDVAR, PIPELINE_WAIT_SPIN, PIPELINE_WAIT_PARK };
+
+// Latency histogram buckets. Bucket i counts lines that took from 2^i up to
+// 2^(i+1) nanoseconds to get through the pipeline.
+#define LATENCY_BUCKETS 40
+
+/* Statistics are gathered unless built with -DPIPELINE_NO_STATS, in which
+ * case none of the counters or the code that updates them exist. */
+
+/* A piece of input: a whole line, or part of one that did not fit. The
+ * stages pass pointers to these along, so whoever holds one owns its text
+ * until it is handed to the next ring. A line a stage dropped still travels
+ * to the end so it can go back to the pool, but no later stage sees it.
+ *
+ * text points at the line's own buffer when the first stage gets it. A
+ * first stage that already has the input in memory may point text into that
+ * instead of copying, as long as the bytes stay put until the line comes
+ * back to the pool. text is not NUL-terminated. */
+typedef struct {
+    bool dropped;
+#ifndef PIPELINE_NO_STATS
+    uint64_t born;    // When its batch's first line was read, in nanoseconds
+#endif
+    size_t length;
+    char* text;
+    char buffer[MAX_LENGTH];
+} Line;
+
+/* Single-producer/single-consumer ring between two threads. head and tail
+ * only ever increase; each is written by one thread and read by the other
+ * with acquire/release ordering, so the hand-off itself takes no lock. The
+ * mutex and condition variable are only touched when a ring is actually
+ * empty or full and a thread has to sleep. */
+typedef struct {
+    // Next slot the producer will fill, written by the producer only
+    _Alignas(RING_ALIGN) atomic_size_t tail;
+    // Producer's last look at head, refreshed only when the ring seems full
+    size_t head_cache;
+
+    // Next slot the consumer will read, written by the consumer only
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    // Consumer's last look at tail, refreshed only when the ring seems empty
+    size_t tail_cache;
+
+    // Threads asleep on this ring, so the other side knows to wake them
+    _Alignas(CACHE_LINE) atomic_int sleepers;
+    int wait_policy;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // Bumped on every wake-up with PIPELINE_WAIT_PARK, which sleeps on it
+    atomic_uint futex;
+
+    // NULL marks the end of the stream
+    _Alignas(CACHE_LINE) Line* lines[RING_SIZE];
+} Ring;
+
+/* One step of a pipeline. Every function is optional except read for the
+ * first stage and process for the others, and each gets state as its first
+ * argument. */
+typedef struct {
+    const char* name;
+    void* state;
+
+    // Called before any thread starts. Nonzero stops the pipeline running.
+    int (*init)(void* state);
+    // First stage only: fill line and return true, or return false at the
+    // end of the input.
+    bool (*read)(void* state, Line* line);
+    // First stage only: true if read will not block, waiting up to timeout
+    // milliseconds to find out. Lets a partial batch go out while it waits.
+    bool (*ready)(void* state, int timeout);
+    // Transform line in place. Returning false drops it.
+    bool (*process)(void* state, Line* line);
+    // Called when the stage's thread is about to wait for more lines.
+    void (*idle)(void* state);
+    // Called once the stage has seen every line.
+    void (*finish)(void* state);
+    // Called after every thread has finished.
+    void (*teardown)(void* state);
+} Stage;
+
+#ifndef PIPELINE_NO_STATS
+/* Counters for one stage and for one thread. Each is written by a single
+ * thread only, and sits on cache lines of its own so that threads never
+ * fight over them; other threads may read them at any time. */
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ullong lines;
+    atomic_ullong bytes;
+    atomic_ullong dropped;
+} StageStats;
+
+typedef struct {
+    // Time spent waiting for lines, and for room (or free lines) to put them
+    _Alignas(CACHE_LINE) atomic_ullong empty_ns;
+    atomic_ullong full_ns;
+    // Lines found waiting in the input ring each time the thread took some
+    atomic_ullong gets;
+    atomic_ullong occupancy_sum;
+    atomic_ullong occupancy_max;
+    // From being read to leaving the last stage; last thread only
+    atomic_ullong latency[LATENCY_BUCKETS];
+    // CPU time the thread used, once it has finished
+    atomic_ullong cpu_ns;
+} ThreadStats;
+#endif
+
+// Where pipeline_add puts a stage
+enum { PIPELINE_NEW_THREAD, PIPELINE_FUSE };
+
+// A run of stages that share a thread
+typedef struct Pipeline Pipeline;
+typedef struct {
+    Pipeline* pipeline;
+    int index;
+    int first;
+    int count;
+    Ring* in;         // NULL for the thread running the first stage
+    Ring* out;        // NULL for the thread running the last stage
+    pthread_t tid;
+} PipelineThread;
+
+struct Pipeline {
+    Stage stages[MAX_STAGES];
+    int nstages;
+    PipelineThread threads[MAX_STAGES];
+    int nthreads;
+
+    // Lines moved per ring operation, and how long the first stage holds on
+    // to a partial batch while its input has nothing for it
+    int batch_size;
+    int flush_timeout;
+    // PIPELINE_WAIT_CONDVAR unless changed after pipeline_init
+    int wait_policy;
+    // CPU each thread is pinned to, or -1 to let it run anywhere. All -1
+    // after pipeline_init. A thread's input ring is put on its CPU's node.
+    int cpus[MAX_STAGES];
+
+    // rings[i] carries lines from thread i to thread i + 1
+    Ring rings[MAX_STAGES];
+    // Lines go back from the last thread to the first through here.
+    Ring free_lines;
+    Line pool[POOL_SIZE];
+
+#ifndef PIPELINE_NO_STATS
+    StageStats stage_stats[MAX_STAGES];
+    ThreadStats thread_stats[MAX_STAGES];
+#endif
+};
+
+extern void pipeline_init(Pipeline* pipeline, int batch_size, int flush_timeout);
+// Add a stage after the others, on a thread of its own or fused onto the
+// thread of the stage before it. Returns 0, or -1 if there are too many.
+extern int pipeline_add(Pipeline* pipeline, Stage stage, int placement);
+// Run the pipeline until the first stage runs out of input. Returns 0, or
+// -1 if a stage failed to initialize.
+extern int pipeline_run(Pipeline* pipeline);
+// Print the statistics so far, as a table or as JSON. Safe to call from any
+// thread while the pipeline runs. Prints nothing without statistics.
+extern void pipeline_print_stats(Pipeline* pipeline, FILE* stream, bool json);
+// Latency in nanoseconds that the given fraction of lines stayed under, to
+// the histogram's power-of-two resolution. 0 without statistics.
+extern unsigned long long pipeline_latency(Pipeline* pipeline, double fraction);
+/* Choose CPUs for n threads that hand work along in order, from the CPUs
+ * this process may run on. Neighbours get CPUs that share an L2 cache where
+ * possible, then ones that share an L3, then ones in the same package, going
+ * by the topology in sysfs. CPUs are reused if there are more threads than
+ * CPUs. Returns 0, or -1 if no CPU could be found. */
+extern int pipeline_place(int* cpus, int n);
+// Pin a thread about to be created with attr to cpu, unless it is -1. A CPU
+// this process may not run on is reported and left out.
+extern void pipeline_set_cpu(pthread_attr_t* attr, int cpu);
+
+#endif
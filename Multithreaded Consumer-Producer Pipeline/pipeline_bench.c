@@ -0,0 +1,150 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+
+/* Compares the ring wait policies. Each policy runs two workloads through a
+ * chain of pass-through stages, one thread per stage:
+ *
+ *   bulk    as many lines as possible, as fast as possible
+ *   sparse  one line at a time, with a pause between lines, so every
+ *           hand-off finds the next thread waiting
+ *
+ * Results are CSV on stdout:
+ *
+ *   policy,workload,threads,lines,seconds,lines_per_s,cpu_ns_per_line,p50_ns,p99_ns
+ *
+ * CPU time is for the whole process. Latencies are from the pipeline's own
+ * histogram, so they are powers of two. SPIN is skipped when there are more
+ * threads than CPUs, where it would mostly measure the scheduler.
+ */
+
+#ifdef PIPELINE_NO_STATS
+#error pipeline_bench needs the pipeline statistics
+#endif
+
+#define LINE_LENGTH 64
+
+static const char* policy_names[] = { "cond", "spin", "park" };
+
+// The source stage: count lines down, optionally pausing before each.
+typedef struct {
+    long remaining;
+    long pause_ns;
+} Source;
+
+static bool read_line(void* state, Line* line){
+    Source* source = state;
+    if (source->remaining-- <= 0) {
+        return false;
+    }
+    if (source->pause_ns > 0) {
+        struct timespec pause = { 0, source->pause_ns };
+        nanosleep(&pause, NULL);
+    }
+    memset(line->text, 'x', LINE_LENGTH);
+    line->length = LINE_LENGTH;
+    return true;
+}
+
+// Every other stage touches the line so the work is not optimised away.
+static bool touch_line(void* state, Line* line){
+    line->text[0] ^= 1;
+    return true;
+}
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_seconds(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+static Pipeline pipeline;
+
+static void run(int policy, const char* workload, int threads, long lines, int batch_size, long pause_ns){
+    Source source = { lines, pause_ns };
+    Stage first = { .name = "source", .state = &source, .read = read_line };
+    Stage next = { .name = "touch", .process = touch_line };
+
+    pipeline_init(&pipeline, batch_size, 0);
+    pipeline.wait_policy = policy;
+    pipeline_add(&pipeline, first, PIPELINE_NEW_THREAD);
+    for (int i = 1; i < threads; i++) {
+        pipeline_add(&pipeline, next, PIPELINE_NEW_THREAD);
+    }
+
+    double cpu = cpu_seconds();
+    double start = now();
+    pipeline_run(&pipeline);
+    double seconds = now() - start;
+    cpu = cpu_seconds() - cpu;
+
+    printf("%s,%s,%d,%ld,%.3f,%.0f,%.0f,%llu,%llu\n", policy_names[policy], workload, threads,
+           lines, seconds, lines / seconds, cpu * 1e9 / lines,
+           pipeline_latency(&pipeline, 0.5), pipeline_latency(&pipeline, 0.99));
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]){
+    long lines = 1000000;
+    long sparse_lines = 2000;
+    long pause_us = 100;
+    int threads = 4;
+    int batch_size = 16;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:p:k:b:")) != -1) {
+        switch (opt) {
+        case 'n':
+            lines = atol(optarg);
+            break;
+        case 'm':
+            sparse_lines = atol(optarg);
+            break;
+        case 'p':
+            pause_us = atol(optarg);
+            break;
+        case 'k':
+            threads = atoi(optarg);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n BULK_LINES] [-m SPARSE_LINES] [-p PAUSE_US] [-k THREADS] [-b BATCH]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (lines < 1 || sparse_lines < 1 || pause_us < 0 || pause_us >= 1000000 ||
+        threads < 2 || threads > MAX_STAGES || batch_size < 1 || batch_size > RING_SIZE) {
+        fprintf(stderr, "%s: option out of range\n", argv[0]);
+        return 1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("policy,workload,threads,lines,seconds,lines_per_s,cpu_ns_per_line,p50_ns,p99_ns\n");
+    for (int policy = PIPELINE_WAIT_CONDVAR; policy <= PIPELINE_WAIT_PARK; policy++) {
+        if (policy == PIPELINE_WAIT_SPIN && threads > cpus) {
+            fprintf(stderr, "skipping spin: %d threads but %ld CPUs\n", threads, cpus);
+            continue;
+        }
+        run(policy, "bulk", threads, lines, batch_size, 0);
+        // One line per batch, or the source would sit on each line until
+        // the batch filled up
+        run(policy, "sparse", threads, sparse_lines, 1, pause_us * 1000);
+    }
+    return 0;
+}
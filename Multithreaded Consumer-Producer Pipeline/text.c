@@ -0,0 +1,122 @@
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "text.h"
+
+void input_init(Input* input, ssize_t (*fill)(void* state, char* buffer, size_t size), void* state){
+    input->block = 0;
+    input->start = 0;
+    input->end = 0;
+    input->eof = false;
+    input->fill = fill;
+    input->state = state;
+}
+
+/* The unsplit input holds a whole piece if it has a newline, as much as a
+ * piece can take, or the last of the input. */
+bool input_buffered(Input* input){
+    size_t n = input->end - input->start;
+    return input->eof || n >= MAX_LENGTH - 1 ||
+           memchr(input->blocks[input->block] + input->start, '\n', n) != NULL;
+}
+
+/* Read more input after what is buffered. Once the block is full, the
+ * partial line at its end is moved to the start of the next block, which
+ * copies less than MAX_LENGTH bytes, and reading carries on there. */
+static void fill_input(Input* input){
+    if (input->end == INPUT_SIZE) {
+        char* block = input->blocks[input->block];
+        input->block = (input->block + 1) % INPUT_BLOCKS;
+        input->end -= input->start;
+        memcpy(input->blocks[input->block], block + input->start, input->end);
+        input->start = 0;
+    }
+    ssize_t n = input->fill(input->state, input->blocks[input->block] + input->end, INPUT_SIZE - input->end);
+    if (n <= 0) {
+        input->eof = true;
+    } else {
+        input->end += n;
+    }
+}
+
+size_t input_piece(Input* input, char** text){
+    while (!input_buffered(input)) {
+        fill_input(input);
+    }
+    char* start = input->blocks[input->block] + input->start;
+    size_t length = input->end - input->start;
+    if (length > MAX_LENGTH - 1) {
+        length = MAX_LENGTH - 1;
+    }
+    char* newline = memchr(start, '\n', length);
+    if (newline != NULL) {
+        length = newline - start + 1;
+    }
+
+    /* A piece that stops short of the newline must not end in an odd run of
+     * '+', or its last '+' would miss its partner at the start of the next
+     * piece. Leaving that one for the next read keeps every "++" whole. */
+    if (newline == NULL && length > 1 && start[length - 1] == '+') {
+        size_t run = 1;
+        while (run < length && start[length - 1 - run] == '+') {
+            run++;
+        }
+        if (run % 2 == 1) {
+            length--;
+        }
+    }
+    input->start += length;
+    *text = start;
+    return length;
+}
+
+// Replace every '\n' in text with a space. memchr does the scanning.
+void replace_separators(char* text, size_t length){
+    char* end = text + length;
+    char* p = text;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        *p++ = ' ';
+    }
+}
+
+/* Replace every "++" in text with "^", pairing them left to right, and every
+ * '\n' with a space, in a single pass that writes behind where it reads.
+ * Returns the new length. With SSE2, 16 characters at a time are checked
+ * for either and passed over whole when there are none. */
+size_t replace_plus_pairs(char* text, size_t length){
+    const char* r = text;
+    const char* end = text + length;
+    char* w = text;
+
+    while (r < end) {
+#ifdef __SSE2__
+        if (end - r >= 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)r);
+            __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('+')),
+                                        _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+            unsigned mask = _mm_movemask_epi8(hits);
+            size_t skip = mask ? __builtin_ctz(mask) : 16;
+            if (w != r) {
+                memmove(w, r, skip);
+            }
+            r += skip;
+            w += skip;
+            if (skip == 16) {
+                continue;
+            }
+        }
+#endif
+        if (*r == '\n') {
+            *w++ = ' ';
+            r++;
+        } else if (*r == '+' && r + 1 < end && r[1] == '+') {
+            *w++ = '^';
+            r += 2;
+        } else {
+            *w++ = *r++;
+        }
+    }
+    return w - text;
+}
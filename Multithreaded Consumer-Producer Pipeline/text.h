@@ -0,0 +1,53 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "pipeline.h"
+
+/* The text handling shared by mtp and its benchmark: splitting input into
+ * pieces where it was read, and the two transforms. */
+
+// Input is read into blocks this big, and lines are passed on as slices of
+// them rather than copied out
+#define INPUT_SIZE 65536
+
+/* Blocks the input cycles through. Lines come back to the pool in the order
+ * they were read, so the lines still in use are the last POOL_SIZE pieces,
+ * which are at most POOL_SIZE * MAX_LENGTH bytes of consecutive input. Every
+ * block holds at least INPUT_SIZE - MAX_LENGTH new bytes, so those pieces span
+ * this many blocks less one at most, leaving a block that nothing points
+ * into for the reader to move on to. */
+#define INPUT_BLOCKS (POOL_SIZE * MAX_LENGTH / (INPUT_SIZE - MAX_LENGTH) + 3)
+
+typedef struct {
+    // The block being read into, and the part of it not yet split into lines
+    char blocks[INPUT_BLOCKS][INPUT_SIZE];
+    int block;
+    size_t start;
+    size_t end;
+    bool eof;
+    // Reads up to size bytes into buffer like read(), blocking until it has
+    // some. Returning 0 or less ends the input.
+    ssize_t (*fill)(void* state, char* buffer, size_t size);
+    void* state;
+} Input;
+
+extern void input_init(Input* input, ssize_t (*fill)(void* state, char* buffer, size_t size), void* state);
+// True if input_piece can return without calling fill
+extern bool input_buffered(Input* input);
+/* Point text at the next piece of the current input line, up to
+ * MAX_LENGTH - 1 characters of it, where it sits in the input block. Returns
+ * its length, or 0 at the end of the input. The piece stays valid until
+ * INPUT_BLOCKS - 1 more blocks have been read. */
+extern size_t input_piece(Input* input, char** text);
+
+// Replace every '\n' in text with a space.
+extern void replace_separators(char* text, size_t length);
+// Replace every "++" in text with "^", pairing them left to right, and every
+// '\n' with a space. Returns the new length.
+extern size_t replace_plus_pairs(char* text, size_t length);
+
+#endif
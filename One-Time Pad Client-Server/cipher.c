@@ -0,0 +1,175 @@
+#include <pthread.h>
+
+#include "cipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+enum { LEVEL_SCALAR, LEVEL_SSE2, LEVEL_AVX2 };
+
+static const char characters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+// The value of a character, or -1 if it is not in the alphabet
+static int character_value(unsigned char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  }
+  return c == ' ' ? 26 : -1;
+}
+
+/* Kernels convert as many characters as they can a whole vector at a time,
+ * and return how many. A character outside the alphabet sets *bad. */
+typedef size_t (*cipher_kernel)(int decrypt, const char *text, const char *key, char *out, size_t length,
+                                int *bad);
+
+static size_t scalar_kernel(int decrypt, const char *text, const char *key, char *out, size_t length,
+                            int *bad) {
+  for (size_t i = 0; i < length; i++) {
+    int t = character_value(text[i]);
+    int k = character_value(key[i]);
+    int v;
+    if (t < 0 || k < 0) {
+      *bad = 1;
+      return length;
+    }
+    if (decrypt) {
+      v = t - k;
+      v += v < 0 ? 27 : 0;
+    } else {
+      v = t + k;
+      v -= v >= 27 ? 27 : 0;
+    }
+    out[i] = characters[v];
+  }
+  return length;
+}
+
+#ifdef HAVE_X86_KERNELS
+/* Per byte: subtract 'A', turn a space into 26, and note anything that is
+ * neither a letter nor a space. Then add or subtract, bring the result back
+ * into 0 to 26 with one masked subtract or add of 27, and map it back the
+ * same way. Values stay within -26 to 52, so signed byte compares will do. */
+__attribute__((target("sse2")))
+static __m128i sse2_values(__m128i c, __m128i *invalid) {
+  const __m128i n25 = _mm_set1_epi8(25);
+  __m128i v = _mm_sub_epi8(c, _mm_set1_epi8('A'));
+  // Letters are the bytes that land in 0 to 25, unsigned
+  __m128i letter = _mm_cmpeq_epi8(_mm_max_epu8(v, n25), n25);
+  __m128i space = _mm_cmpeq_epi8(c, _mm_set1_epi8(' '));
+  *invalid = _mm_or_si128(*invalid, _mm_andnot_si128(_mm_or_si128(letter, space), _mm_set1_epi8(-1)));
+  return _mm_or_si128(_mm_and_si128(letter, v), _mm_andnot_si128(letter, _mm_set1_epi8(26)));
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_kernel(int decrypt, const char *text, const char *key, char *out, size_t length, int *bad) {
+  const __m128i n26 = _mm_set1_epi8(26), n27 = _mm_set1_epi8(27);
+  __m128i invalid = _mm_setzero_si128();
+  size_t i = 0;
+  for (; length - i >= 16; i += 16) {
+    __m128i t = sse2_values(_mm_loadu_si128((const __m128i *)(text + i)), &invalid);
+    __m128i k = sse2_values(_mm_loadu_si128((const __m128i *)(key + i)), &invalid);
+    __m128i v;
+    if (decrypt) {
+      v = _mm_sub_epi8(t, k);
+      v = _mm_add_epi8(v, _mm_and_si128(_mm_cmpgt_epi8(_mm_setzero_si128(), v), n27));
+    } else {
+      v = _mm_add_epi8(t, k);
+      v = _mm_sub_epi8(v, _mm_and_si128(_mm_cmpgt_epi8(v, n26), n27));
+    }
+    __m128i space = _mm_cmpeq_epi8(v, n26);
+    v = _mm_or_si128(_mm_andnot_si128(space, _mm_add_epi8(v, _mm_set1_epi8('A'))),
+                     _mm_and_si128(space, _mm_set1_epi8(' ')));
+    _mm_storeu_si128((__m128i *)(out + i), v);
+  }
+  if (_mm_movemask_epi8(invalid)) {
+    *bad = 1;
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static __m256i avx2_values(__m256i c, __m256i *invalid) {
+  const __m256i n25 = _mm256_set1_epi8(25);
+  __m256i v = _mm256_sub_epi8(c, _mm256_set1_epi8('A'));
+  __m256i letter = _mm256_cmpeq_epi8(_mm256_max_epu8(v, n25), n25);
+  __m256i space = _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' '));
+  *invalid = _mm256_or_si256(*invalid, _mm256_andnot_si256(_mm256_or_si256(letter, space), _mm256_set1_epi8(-1)));
+  return _mm256_blendv_epi8(_mm256_set1_epi8(26), v, letter);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_kernel(int decrypt, const char *text, const char *key, char *out, size_t length, int *bad) {
+  const __m256i n26 = _mm256_set1_epi8(26), n27 = _mm256_set1_epi8(27);
+  __m256i invalid = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; length - i >= 32; i += 32) {
+    __m256i t = avx2_values(_mm256_loadu_si256((const __m256i *)(text + i)), &invalid);
+    __m256i k = avx2_values(_mm256_loadu_si256((const __m256i *)(key + i)), &invalid);
+    __m256i v;
+    if (decrypt) {
+      v = _mm256_sub_epi8(t, k);
+      v = _mm256_add_epi8(v, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), v), n27));
+    } else {
+      v = _mm256_add_epi8(t, k);
+      v = _mm256_sub_epi8(v, _mm256_and_si256(_mm256_cmpgt_epi8(v, n26), n27));
+    }
+    v = _mm256_blendv_epi8(_mm256_add_epi8(v, _mm256_set1_epi8('A')), _mm256_set1_epi8(' '),
+                           _mm256_cmpeq_epi8(v, n26));
+    _mm256_storeu_si256((__m256i *)(out + i), v);
+  }
+  if (_mm256_movemask_epi8(invalid)) {
+    *bad = 1;
+  }
+  return i;
+}
+
+static const cipher_kernel kernels[CIPHER_NLEVELS] = { scalar_kernel, sse2_kernel, avx2_kernel };
+#else
+static const cipher_kernel kernels[CIPHER_NLEVELS] = { scalar_kernel, scalar_kernel, scalar_kernel };
+#endif
+
+int cipher_cpu_level(void) {
+#ifdef HAVE_X86_KERNELS
+  if (__builtin_cpu_supports("avx2")) {
+    return LEVEL_AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return LEVEL_SSE2;
+  }
+#endif
+  return LEVEL_SCALAR;
+}
+
+const char *cipher_level_name(int level) {
+  static const char *names[CIPHER_NLEVELS] = { "scalar", "sse2", "avx2" };
+  return level >= 0 && level < CIPHER_NLEVELS ? names[level] : "unknown";
+}
+
+static int apply_kernel(cipher_kernel kernel, char mode, const char *text, const char *key, char *out,
+                        size_t length) {
+  int decrypt = mode == 'd';
+  int bad = 0;
+  // The scalar kernel finishes whatever does not fill a whole vector
+  size_t done = kernel(decrypt, text, key, out, length, &bad);
+  scalar_kernel(decrypt, text + done, key + done, out + done, length - done, &bad);
+  return bad ? -1 : 0;
+}
+
+int cipher_apply_at(int level, char mode, const char *text, const char *key, char *out, size_t length) {
+  return apply_kernel(kernels[level], mode, text, key, out, length);
+}
+
+// The kernel cipher_apply uses, picked for the CPU on the first call
+static cipher_kernel active_kernel;
+static pthread_once_t active_once = PTHREAD_ONCE_INIT;
+
+static void choose_kernel(void) {
+  active_kernel = kernels[cipher_cpu_level()];
+}
+
+int cipher_apply(char mode, const char *text, const char *key, char *out, size_t length) {
+  pthread_once(&active_once, choose_kernel);
+  return apply_kernel(active_kernel, mode, text, key, out, length);
+}
@@ -0,0 +1,24 @@
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stddef.h>
+
+/* The one-time pad itself. 'A' to 'Z' stand for 0 to 25 and a space for 26;
+ * encrypting adds the key mod 27 and decrypting subtracts it. Whole buffers
+ * go through SSE2 or AVX2 where the CPU has them, with a conditional
+ * subtract or add in place of a division, and a scalar loop for the rest. */
+
+// Kernel tiers: level 0 is the scalar code and higher levels are wider
+// SIMD. cipher_cpu_level() is the widest the running CPU supports.
+#define CIPHER_NLEVELS 3
+int cipher_cpu_level(void);
+const char *cipher_level_name(int level);
+
+// Encrypt ('e') or decrypt ('d') length characters of text with key into
+// out. Returns 0, or -1 if any character is not 'A' to 'Z' or a space.
+int cipher_apply(char mode, const char *text, const char *key, char *out, size_t length);
+// The same with the kernel of the given level, which must not be above
+// cipher_cpu_level(). For tests; cipher_apply picks the level once.
+int cipher_apply_at(int level, char mode, const char *text, const char *key, char *out, size_t length);
+
+#endif
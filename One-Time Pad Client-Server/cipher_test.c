@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cipher.h"
+
+/* Checks every cipher kernel the CPU supports against the definition, on all
+ * 27 x 27 pairs of characters in both directions, and checks that every byte
+ * outside the alphabet is refused. Prints what failed and exits 1, or exits
+ * 0 once everything has passed. */
+
+#define PAIRS (27 * 27)
+// Rotations of the pairs tried, so that each pair lands in every lane of
+// the widest vector as well as in the scalar tail
+#define SHIFTS 32
+
+static const char characters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+static int failures;
+
+static int in_alphabet(int c) {
+  return (c >= 'A' && c <= 'Z') || c == ' ';
+}
+
+static void check_pairs(int level, const char *name) {
+  char text[PAIRS], key[PAIRS], out[PAIRS];
+
+  for (int shift = 0; shift < SHIFTS; shift++) {
+    for (int i = 0; i < PAIRS; i++) {
+      int pair = (i + shift) % PAIRS;
+      text[i] = characters[pair / 27];
+      key[i] = characters[pair % 27];
+    }
+    for (int decrypt = 0; decrypt <= 1; decrypt++) {
+      int rc = level < 0 ? cipher_apply(decrypt ? 'd' : 'e', text, key, out, PAIRS)
+                         : cipher_apply_at(level, decrypt ? 'd' : 'e', text, key, out, PAIRS);
+      if (rc < 0) {
+        fprintf(stderr, "%s: refused valid input\n", name);
+        failures++;
+        continue;
+      }
+      for (int i = 0; i < PAIRS; i++) {
+        int t = strchr(characters, text[i]) - characters;
+        int k = strchr(characters, key[i]) - characters;
+        int expected = decrypt ? (t - k + 27) % 27 : (t + k) % 27;
+        if (out[i] != characters[expected]) {
+          fprintf(stderr, "%s: %s '%c' with '%c' gave '%c', not '%c'\n", name,
+                  decrypt ? "decrypting" : "encrypting", text[i], key[i], out[i], characters[expected]);
+          failures++;
+        }
+      }
+    }
+  }
+}
+
+static void check_bad_characters(int level, const char *name) {
+  char text[64], key[64], out[64];
+
+  for (int c = 0; c < 256; c++) {
+    if (in_alphabet(c)) {
+      continue;
+    }
+    // In text and then in key, at a position that moves with c
+    for (int which = 0; which <= 1; which++) {
+      memset(text, 'A', sizeof(text));
+      memset(key, ' ', sizeof(key));
+      (which ? key : text)[c % sizeof(text)] = c;
+      int rc = level < 0 ? cipher_apply('e', text, key, out, sizeof(out))
+                         : cipher_apply_at(level, 'e', text, key, out, sizeof(out));
+      if (rc == 0) {
+        fprintf(stderr, "%s: accepted byte %d in the %s\n", name, c, which ? "key" : "text");
+        failures++;
+      }
+    }
+  }
+}
+
+int main(void) {
+  for (int level = 0; level <= cipher_cpu_level(); level++) {
+    check_pairs(level, cipher_level_name(level));
+    check_bad_characters(level, cipher_level_name(level));
+  }
+  // And whatever cipher_apply picked for itself
+  check_pairs(-1, "cipher_apply");
+  check_bad_characters(-1, "cipher_apply");
+
+  if (failures) {
+    fprintf(stderr, "cipher_test: %d failures\n", failures);
+    return 1;
+  }
+  fprintf(stderr, "cipher_test: all pairs passed (cpu level: %s)\n", cipher_level_name(cipher_cpu_level()));
+  return 0;
+}
@@ -1,7 +1,12 @@
 #!/bin/bash
-gcc -o enc_server enc_server.c
-gcc -o enc_client enc_client.c
-gcc -o dec_server dec_server.c
-gcc -o dec_client dec_client.c
+gcc -O2 -c -o cipher.o cipher.c
+gcc -c -o protocol.o protocol.c
+gcc -c -o event_server.o event_server.c
+gcc -pthread -o enc_server enc_server.c cipher.o protocol.o event_server.o
+gcc -pthread -o enc_client enc_client.c cipher.o protocol.o
+gcc -pthread -o dec_server dec_server.c cipher.o protocol.o event_server.o
+gcc -pthread -o dec_client dec_client.c cipher.o protocol.o
 gcc -o keygen keygen.c
+gcc -pthread -o cipher_test cipher_test.c cipher.o
+gcc -pthread -o event_test event_test.c cipher.o protocol.o event_server.o
 
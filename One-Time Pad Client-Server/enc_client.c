@@ -8,9 +8,10 @@
 #include <sys/socket.h> // send(),recv()
 #include <netdb.h>      // gethostbyname()
 
+#include "protocol.h"
+
 #define RESPONSE_WRONG_SERVER 'w'
 #define RESPONSE_TERMINATION 't'
-#define RESPONSE_CHARACTER 'c'
 
 // Function prototype
 int is_valid_character(int character);
@@ -114,7 +115,33 @@ int main(int argc, char *argv[]) {
     error("CLIENT: ERROR connecting");
   }
 
+  // Use the framed protocol if the server speaks it, or else version 1
+  int version = otp_client_hello(socketFD, 'e');
+  if (version == -2) {
+    error("CLIENT: ERROR writing to socket");
+  }
+
   int exitFlag = 0;
+  if (version == -1) {
+    fprintf(stderr, "CLIENT: Wrong port: %d\n", atoi(argv[3]));
+    exitFlag = 1;
+  } else if (version == OTP_VERSION_FRAMED) {
+    char *message, *keyText;
+    size_t length;
+    int bad = otp_read_message(plaintext, key, plaintextSize, &message, &keyText, &length);
+    if (bad) {
+      fprintf(stderr, "CLIENT: Issue with character in %s.\n", bad == 1 ? argv[1] : argv[2]);
+      exit(1);
+    }
+    if (otp_client_framed(socketFD, message, keyText, length, stdout) < 0) {
+      error("CLIENT: ERROR reading from socket");
+    }
+    fprintf(stdout, "\n");
+    free(message);
+    free(keyText);
+    exitFlag = 1;
+  }
+
   while (!exitFlag) {
     int plaintext_character = fgetc(plaintext);
     int key_character = fgetc(key);
@@ -144,7 +171,7 @@ int main(int argc, char *argv[]) {
     memset(buffer, '\0', sizeof(buffer));
 
     // Receive the response from the server
-    charsRead = recv(socketFD, buffer, sizeof(buffer) - 1, 0);
+    charsRead = otp_recv_all(socketFD, buffer, sizeof(buffer) - 1);
     if (charsRead < 0) {
       error("CLIENT: ERROR reading from socket");
     }
@@ -159,10 +186,11 @@ int main(int argc, char *argv[]) {
         fprintf(stdout, "\n");
         exitFlag = 1;
         break;
-      case RESPONSE_CHARACTER:
-        putc(buffer[0], stdout);
-        break;
       default:
+        // The server puts RESPONSE_CHARACTER second, after the character
+        if (buffer[1] == RESPONSE_CHARACTER) {
+          putc(buffer[0], stdout);
+        }
         break;
     }
   }
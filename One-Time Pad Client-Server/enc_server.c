@@ -7,13 +7,13 @@
 #include <sys/wait.h>
 #include <netinet/in.h>
 
+#include "cipher.h"
+#include "event_server.h"
+#include "protocol.h"
+
 #define MAX_CHILDREN 5
 #define BUFFER_SIZE 4
-#define WRONG_CLIENT 'w'
 #define TERMINATION_SIGNAL 't'
-#define RESPONSE_CHARACTER 'c'
-
-char characters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
 
 void error(const char *msg) {
   perror(msg);
@@ -25,6 +25,7 @@ void error(const char *msg) {
  * and handles errors. */
 void handle_connection(int connectionSocket, const struct sockaddr_in *clientAddress) {
   char buffer[BUFFER_SIZE];
+  int first = 1;
 
   while (1) {
     memset(buffer, 'a', BUFFER_SIZE - 1);
@@ -34,6 +35,18 @@ void handle_connection(int connectionSocket, const struct sockaddr_in *clientAdd
       error("ERROR reading from socket");
     }
 
+    // A framed client says hello first; anything else speaks version 1
+    if (first && charsRead > 0 && buffer[0] == OTP_HELLO) {
+      int status = 0;
+      if (otp_recv_all(connectionSocket, buffer + charsRead, BUFFER_SIZE - 1 - charsRead) < 0 ||
+          otp_serve_framed(connectionSocket, 'e', buffer) < 0) {
+        status = 2;
+      }
+      close(connectionSocket);
+      exit(status);
+    }
+    first = 0;
+
     if (buffer[2] != 'e' && buffer[2] != 'a') {
       // Wrong client connected
       fprintf(stderr, "Wrong client connected. Attempted port: %d\n", ntohs(clientAddress->sin_port));
@@ -41,10 +54,9 @@ void handle_connection(int connectionSocket, const struct sockaddr_in *clientAdd
     } else if (strncmp(buffer, "@@e", 3) == 0) {
       // Termination signal received from the client
       buffer[2] = TERMINATION_SIGNAL;
-    } else if (buffer[0] != '@' && buffer[1] != '@' && buffer[2] == 'e') {
+    } else if (buffer[0] != '@' && buffer[1] != '@' && buffer[2] == 'e' &&
+               cipher_apply('e', buffer, buffer + 1, buffer, 1) == 0) {
       // Encryption request received
-      int ciphertext_index = (buffer[0] - 'A' + buffer[1] - 'A') % 27;
-      buffer[0] = characters[ciphertext_index];
       buffer[1] = RESPONSE_CHARACTER;
       buffer[2] = '\0';
     } else {
@@ -76,13 +88,33 @@ int main(int argc, char *argv[]) {
   int active_connections = 0;
   struct sockaddr_in serverAddress, clientAddress;
   socklen_t sizeOfClientInfo = sizeof(clientAddress);
-
-  // Check usage & args
-  if (argc < 2) {
-    fprintf(stderr, "USAGE: %s port\n", argv[0]);
+  int eventDriven = 0;
+  int threads = 0;
+  int arg = 1;
+
+  // Check usage & args. --epoll serves every client from this one process,
+  // and --threads N from N event loops in it.
+  while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+    if (strcmp(argv[arg], "--epoll") == 0) {
+      eventDriven = 1;
+      arg++;
+    } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0) {
+      threads = atoi(argv[arg + 1]);
+      arg += 2;
+    } else {
+      break;
+    }
+  }
+  if (argc - arg != 1) {
+    fprintf(stderr, "USAGE: %s [--epoll | --threads N] port\n", argv[0]);
     exit(1);
   }
 
+  if (threads > 0) {
+    otp_event_threads(atoi(argv[arg]), 'e', threads);
+    error("ERROR in event loop");
+  }
+
   // Create the socket that will listen for connections
   listenSocket = socket(AF_INET, SOCK_STREAM, 0);
   if (listenSocket < 0) {
@@ -93,7 +125,7 @@ int main(int argc, char *argv[]) {
   // The address should be network capable
   serverAddress.sin_family = AF_INET;
   // Store the port number
-  serverAddress.sin_port = htons(atoi(argv[1]));
+  serverAddress.sin_port = htons(atoi(argv[arg]));
   // Allow a client at any address to connect to this server
   serverAddress.sin_addr.s_addr = INADDR_ANY;
 
@@ -101,6 +133,12 @@ int main(int argc, char *argv[]) {
     error("ERROR on binding");
   }
 
+  if (eventDriven) {
+    listen(listenSocket, SOMAXCONN);
+    otp_event_loop(listenSocket, 'e');
+    error("ERROR in event loop");
+  }
+
   // Start listening for connetions. Allow up to 5 connections to queue up
   listen(listenSocket, 5);
 
@@ -115,16 +153,23 @@ int main(int argc, char *argv[]) {
       error("ERROR on accept");
     }
 
-    if (fork() == -1) {
+    // Fork once: a second fork() here would leave two processes reading
+    // the same connection
+    pid_t pid = fork();
+    if (pid == -1) {
       fprintf(stderr, "fork() failed!");
       break;
-    } else if (fork() == 0) {
+    } else if (pid == 0) {
       // Child process
+      close(listenSocket);
       handle_connection(connectionSocket, &clientAddress);
     } else {
       // Parent process
+      close(connectionSocket);
       active_connections++;
-      waitpid(-1, &child_status, WNOHANG);
+      while (waitpid(-1, &child_status, WNOHANG) > 0) {
+        active_connections--;
+      }
     }
   }
   // Close the listening socket
@@ -0,0 +1,397 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "cipher.h"
+#include "event_server.h"
+#include "protocol.h"
+
+#define MAX_EVENTS 256
+// How often to try accepting again while out of descriptors, in case they
+// were freed by something other than one of this loop's connections closing,
+// such as a connection on another event loop
+#define ACCEPT_RETRY_MS 100
+#define TERMINATION_SIGNAL 't'
+
+// What a connection is waiting to read next
+enum {
+  READ_HELLO,     // The first 3 bytes, a hello or a version 1 request
+  READ_LEGACY,    // Another version 1 request
+  READ_HEADER,    // A version 2 block's length
+  READ_BLOCK,     // A version 2 block's text and key
+};
+
+typedef struct {
+  int fd;
+  int state;
+  unsigned short port;  // The client's, for messages
+  // Bytes wanted before the next step, and how many have arrived
+  size_t need;
+  size_t have;
+  uint32_t length;      // Of the block being read
+  char head[4];         // Requests, hellos and headers are read into here
+  char *block;          // Version 2 text and key, allocated on the first
+  char *result;         // block along with its result
+  // The reply being sent, and whether to hang up once it has gone
+  char reply[3];
+  const char *out;
+  size_t out_length;
+  size_t out_sent;
+  int closing;
+  uint32_t events;      // What epoll is watching for
+} Connection;
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void close_connection(int epollFD, Connection *connection) {
+  epoll_ctl(epollFD, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  free(connection->block);
+  free(connection->result);
+  free(connection);
+}
+
+// Watch for input, or for room to write while a reply is waiting.
+static void watch(int epollFD, Connection *connection) {
+  uint32_t events = connection->out_sent < connection->out_length ? EPOLLOUT : EPOLLIN;
+  if (events != connection->events) {
+    struct epoll_event event = { .events = events, .data.ptr = connection };
+    epoll_ctl(epollFD, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->events = events;
+  }
+}
+
+static void expect(Connection *connection, int state, size_t need) {
+  connection->state = state;
+  connection->need = need;
+  connection->have = 0;
+}
+
+static void queue_reply(Connection *connection, const char *out, size_t length) {
+  connection->out = out;
+  connection->out_length = length;
+  connection->out_sent = 0;
+}
+
+/* Answer a version 1 request the way the forking server does, hanging up
+ * after a wrong client or the end of the message. */
+static void legacy_request(Connection *connection, char mode) {
+  char *request = connection->head;
+  char *reply = connection->reply;
+
+  memcpy(reply, request, 3);
+  if (request[2] != mode) {
+    fprintf(stderr, "Wrong client connected. Attempted port: %d\n", connection->port);
+    reply[2] = WRONG_CLIENT;
+    connection->closing = 1;
+  } else if (request[0] == '@' && request[1] == '@') {
+    reply[2] = TERMINATION_SIGNAL;
+    connection->closing = 1;
+  } else if (request[0] != '@' && request[1] != '@' && cipher_apply(mode, request, request + 1, reply, 1) == 0) {
+    reply[1] = RESPONSE_CHARACTER;
+    reply[2] = '\0';
+  } else {
+    // Nothing to answer
+    expect(connection, READ_LEGACY, 3);
+    return;
+  }
+  queue_reply(connection, reply, 3);
+  expect(connection, READ_LEGACY, 3);
+}
+
+/* Move a connection on once it has read all it needed. Returns -1 if it
+ * broke the protocol and should be dropped. */
+static int step(Connection *connection, char mode) {
+  char *head = connection->head;
+
+  switch (connection->state) {
+  case READ_HELLO:
+    if (head[0] != OTP_HELLO) {
+      legacy_request(connection, mode);
+      return 0;
+    }
+    if (head[1] - '0' < OTP_VERSION_FRAMED) {
+      return -1;
+    }
+    connection->reply[0] = OTP_HELLO;
+    connection->reply[1] = '0' + (head[1] - '0' > OTP_VERSION ? OTP_VERSION : head[1] - '0');
+    connection->reply[2] = head[2] == mode ? mode : WRONG_CLIENT;
+    connection->closing = head[2] != mode;
+    queue_reply(connection, connection->reply, 3);
+    expect(connection, READ_HEADER, 4);
+    return 0;
+  case READ_LEGACY:
+    legacy_request(connection, mode);
+    return 0;
+  case READ_HEADER:
+    memcpy(&connection->length, head, 4);
+    connection->length = ntohl(connection->length);
+    if (connection->length == 0) {
+      connection->closing = 1;
+      return 0;
+    }
+    if (connection->length > OTP_BLOCK_SIZE) {
+      return -1;
+    }
+    if (connection->block == NULL) {
+      connection->block = malloc(2 * OTP_BLOCK_SIZE);
+      connection->result = malloc(OTP_BLOCK_SIZE);
+      if (connection->block == NULL || connection->result == NULL) {
+        return -1;
+      }
+    }
+    expect(connection, READ_BLOCK, 2 * connection->length);
+    return 0;
+  case READ_BLOCK:
+    if (cipher_apply(mode, connection->block, connection->block + connection->length, connection->result,
+                     connection->length) < 0) {
+      return -1;
+    }
+    queue_reply(connection, connection->result, connection->length);
+    expect(connection, READ_HEADER, 4);
+    return 0;
+  }
+  return -1;
+}
+
+/* Read and answer requests until the socket runs dry or a reply cannot go
+ * out in full. Returns -1 once the connection is finished with. */
+static int serve(Connection *connection, char mode) {
+  while (1) {
+    // Send what is waiting first
+    while (connection->out_sent < connection->out_length) {
+      ssize_t sent = send(connection->fd, connection->out + connection->out_sent,
+                          connection->out_length - connection->out_sent, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR) {
+        continue;
+      }
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+      }
+      if (sent < 0) {
+        return -1;
+      }
+      connection->out_sent += sent;
+    }
+    if (connection->closing) {
+      return -1;
+    }
+
+    char *into = connection->state == READ_BLOCK ? connection->block : connection->head;
+    ssize_t received = recv(connection->fd, into + connection->have, connection->need - connection->have, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (received <= 0) {
+      return -1;
+    }
+    connection->have += received;
+    if (connection->have == connection->need && step(connection, mode) < 0) {
+      return -1;
+    }
+  }
+}
+
+/* True for accept errors that come from running out of descriptors or
+ * memory. The pending connection stays queued, so the listening socket would
+ * stay readable and a level-triggered loop would spin on it. */
+static int out_of_resources(int error) {
+  return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
+}
+
+// Start or stop watching the listening socket for new connections
+static void watch_listener(int epollFD, int listenSocket, int on) {
+  struct epoll_event event = { .events = on ? EPOLLIN : 0, .data.ptr = NULL };
+  epoll_ctl(epollFD, EPOLL_CTL_MOD, listenSocket, &event);
+}
+
+/* Set while the process is short of descriptors and has said so. The limit
+ * is shared by every event loop, so one message covers them all. */
+static atomic_int shortage_reported;
+
+/* Accept every waiting connection. Returns -1 if it had to stop because the
+ * process is out of descriptors, which is only reported once per shortage
+ * rather than once per wakeup. */
+static int accept_connections(int epollFD, int listenSocket) {
+  while (1) {
+    struct sockaddr_in clientAddress;
+    socklen_t sizeOfClientInfo = sizeof(clientAddress);
+    int fd = accept(listenSocket, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
+    if (fd < 0) {
+      if (out_of_resources(errno)) {
+        int error = errno;
+        if (!atomic_exchange(&shortage_reported, 1)) {
+          fprintf(stderr, "ERROR on accept: %s, waiting for connections to close\n", strerror(error));
+        }
+        return -1;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+        perror("ERROR on accept");
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      // Caught up with every waiting client, so any shortage is over
+      if (atomic_load_explicit(&shortage_reported, memory_order_relaxed)) {
+        atomic_store(&shortage_reported, 0);
+      }
+      return 0;
+    }
+
+    Connection *connection = calloc(1, sizeof(Connection));
+    if (connection == NULL || set_nonblocking(fd) < 0) {
+      free(connection);
+      close(fd);
+      continue;
+    }
+    connection->fd = fd;
+    connection->port = ntohs(clientAddress.sin_port);
+    connection->events = EPOLLIN;
+    expect(connection, READ_HELLO, 3);
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) < 0) {
+      free(connection);
+      close(fd);
+    }
+  }
+}
+
+typedef struct {
+  int listenSocket;
+  char mode;
+} EventThread;
+
+static void *event_thread(void *arg) {
+  EventThread *thread = arg;
+  otp_event_loop(thread->listenSocket, thread->mode);
+  perror("ERROR in event loop");
+  exit(1);
+}
+
+// A listening socket on port that other sockets can share with SO_REUSEPORT
+static int listen_shared(int port) {
+  struct sockaddr_in serverAddress;
+  int on = 1;
+  int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenSocket < 0) {
+    return -1;
+  }
+
+  memset(&serverAddress, '\0', sizeof(serverAddress));
+  serverAddress.sin_family = AF_INET;
+  serverAddress.sin_port = htons(port);
+  serverAddress.sin_addr.s_addr = INADDR_ANY;
+  if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+      bind(listenSocket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0 ||
+      listen(listenSocket, SOMAXCONN) < 0) {
+    close(listenSocket);
+    return -1;
+  }
+  return listenSocket;
+}
+
+int otp_event_threads(int port, char mode, int threads) {
+  EventThread *loops = calloc(threads, sizeof(EventThread));
+  if (loops == NULL) {
+    return -1;
+  }
+
+  // Bind every socket before serving, so a port in use fails up front
+  for (int i = 0; i < threads; i++) {
+    loops[i].listenSocket = listen_shared(port);
+    loops[i].mode = mode;
+    if (loops[i].listenSocket < 0) {
+      return -1;
+    }
+  }
+  for (int i = 1; i < threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, event_thread, &loops[i]) != 0) {
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+  // This thread runs the first loop
+  return otp_event_loop(loops[0].listenSocket, mode);
+}
+
+int otp_event_loop(int listenSocket, char mode) {
+  struct epoll_event events[MAX_EVENTS];
+  // Whether new connections are left waiting until one of ours closes, and
+  // when to try accepting again anyway. Busy connections keep epoll_wait from
+  // ever timing out, so the retry goes by the clock rather than by timeouts.
+  int paused = 0;
+  long long retry_at = 0;
+  int epollFD = epoll_create1(0);
+  if (epollFD < 0 || set_nonblocking(listenSocket) < 0) {
+    return -1;
+  }
+
+  // The listening socket is the one event without a connection
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listenSocket, &event) < 0) {
+    return -1;
+  }
+
+  while (1) {
+    int timeout = -1;
+    if (paused) {
+      long long left = retry_at - now_ms();
+      timeout = left > 0 ? (int)left : 0;
+    }
+    int n = epoll_wait(epollFD, events, MAX_EVENTS, timeout);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (paused && now_ms() >= retry_at) {
+      watch_listener(epollFD, listenSocket, 1);
+      paused = 0;
+    }
+    for (int i = 0; i < n; i++) {
+      Connection *connection = events[i].data.ptr;
+      if (connection == NULL) {
+        if (accept_connections(epollFD, listenSocket) < 0) {
+          watch_listener(epollFD, listenSocket, 0);
+          paused = 1;
+          retry_at = now_ms() + ACCEPT_RETRY_MS;
+        }
+      } else if (serve(connection, mode) < 0) {
+        close_connection(epollFD, connection);
+        // A descriptor is free again, so try accepting once more
+        if (paused) {
+          watch_listener(epollFD, listenSocket, 1);
+          paused = 0;
+        }
+      } else {
+        watch(epollFD, connection);
+      }
+    }
+  }
+}
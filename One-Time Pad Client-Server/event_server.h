@@ -0,0 +1,23 @@
+#ifndef EVENT_SERVER_H
+#define EVENT_SERVER_H
+
+/* Serves clients of either protocol version from one thread with epoll,
+ * instead of forking a process per connection. Sockets are non-blocking and
+ * each connection keeps its own state and buffers, so a slow client only
+ * ever holds up itself. While a reply is waiting to go out no more is read
+ * from that client, which bounds what it can make the server hold. */
+
+// Serve mode ('e' or 'd') on listenSocket, which must already be listening.
+// Returns only if epoll fails.
+int otp_event_loop(int listenSocket, char mode);
+
+/* Serve mode on port with threads event loops, each on a thread of its own
+ * with its own SO_REUSEPORT listening socket, so that the kernel spreads new
+ * connections between them and they share nothing but the process's
+ * descriptor limit. A loop that runs short stops accepting and tries again
+ * every ACCEPT_RETRY_MS however busy it is, so descriptors the other loops
+ * free are picked up. Returns only if a socket could not be set up or an
+ * event loop fails. */
+int otp_event_threads(int port, char mode, int threads);
+
+#endif
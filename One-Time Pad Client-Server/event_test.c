@@ -0,0 +1,177 @@
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "event_server.h"
+
+/* Checks that an event loop short of descriptors starts accepting again once
+ * another loop in the same process frees some, even while its own clients
+ * keep it busy. A child process limited to SERVER_FDS descriptors runs two
+ * loops, A and B, on ports of their own, as --threads does with one shared
+ * port. This process then:
+ *
+ *   1. keeps a client on A sending a request every couple of milliseconds,
+ *   2. fills the child's descriptor table with idle clients of B,
+ *   3. connects one more client to A, which cannot be accepted yet,
+ *   4. closes B's idle clients and waits for A to answer the new one.
+ *
+ * Exits 0 if A answered in time, or 1 after saying what went wrong. */
+
+#define SERVER_FDS 32
+#define IDLE_CLIENTS 40
+// How long the new client may wait once B's clients are gone
+#define ACCEPT_WAIT_MS 2000
+
+static volatile int stop_busy;
+
+static int listen_any(int *port) {
+  struct sockaddr_in address;
+  socklen_t size = sizeof(address);
+  int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&address, '\0', sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (listenSocket < 0 || bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listenSocket, SOMAXCONN) < 0 || getsockname(listenSocket, (struct sockaddr *)&address, &size) < 0) {
+    perror("event_test: listen");
+    exit(1);
+  }
+  *port = ntohs(address.sin_port);
+  return listenSocket;
+}
+
+static int connect_to(int port) {
+  struct sockaddr_in address;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&address, '\0', sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    perror("event_test: connect");
+    exit(1);
+  }
+  return fd;
+}
+
+// Wait up to timeout milliseconds for a version 1 reply. Returns 0 or -1.
+static int read_reply(int fd, char *reply, int timeout) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  size_t have = 0;
+
+  while (have < 3) {
+    if (poll(&pfd, 1, timeout) <= 0) {
+      return -1;
+    }
+    ssize_t n = recv(fd, reply + have, 3 - have, 0);
+    if (n <= 0) {
+      return -1;
+    }
+    have += n;
+  }
+  return 0;
+}
+
+static int loopB;
+
+static void *run_loop_b(void *arg) {
+  otp_event_loop(loopB, 'e');
+  return NULL;
+}
+
+// The child: both loops, with only SERVER_FDS descriptors between them
+static void serve(int loopA) {
+  struct rlimit limit = { SERVER_FDS, SERVER_FDS };
+  pthread_t thread;
+  int devnull = open("/dev/null", O_WRONLY);
+
+  // The shortage is expected, so keep its message out of the results
+  dup2(devnull, STDERR_FILENO);
+  close(devnull);
+  if (setrlimit(RLIMIT_NOFILE, &limit) < 0 || pthread_create(&thread, NULL, run_loop_b, NULL) != 0) {
+    exit(1);
+  }
+  otp_event_loop(loopA, 'e');
+  exit(1);
+}
+
+// Keeps loop A's connection busy, so its epoll_wait always has events
+static void *busy_client(void *arg) {
+  int fd = *(int *)arg;
+  char reply[3];
+
+  while (!stop_busy) {
+    if (send(fd, "ABe", 3, 0) != 3 || read_reply(fd, reply, 1000) < 0 || reply[0] != 'B') {
+      fprintf(stderr, "event_test: the busy client on loop A stopped getting answers\n");
+      exit(1);
+    }
+    usleep(2000);
+  }
+  return NULL;
+}
+
+int main(void) {
+  int portA, portB;
+  int loopA = listen_any(&portA);
+  loopB = listen_any(&portB);
+  char reply[3];
+  int idle[IDLE_CLIENTS];
+  int status = 1;
+
+  pid_t child = fork();
+  if (child < 0) {
+    perror("event_test: fork");
+    return 1;
+  }
+  if (child == 0) {
+    serve(loopA);
+  }
+  close(loopA);
+  close(loopB);
+
+  int busy = connect_to(portA);
+  pthread_t busy_thread;
+  pthread_create(&busy_thread, NULL, busy_client, &busy);
+  usleep(200000);
+
+  for (int i = 0; i < IDLE_CLIENTS; i++) {
+    idle[i] = connect_to(portB);
+  }
+  usleep(500000);
+
+  int waiting = connect_to(portA);
+  send(waiting, "AAe", 3, 0);
+  if (read_reply(waiting, reply, 300) == 0) {
+    fprintf(stderr, "event_test: loop A was never short of descriptors\n");
+  } else {
+    for (int i = 0; i < IDLE_CLIENTS; i++) {
+      close(idle[i]);
+    }
+    if (read_reply(waiting, reply, ACCEPT_WAIT_MS) < 0) {
+      fprintf(stderr, "event_test: loop A did not accept again after loop B freed descriptors\n");
+    } else if (reply[0] != 'A' || reply[1] != 'c') {
+      fprintf(stderr, "event_test: wrong reply from loop A\n");
+    } else {
+      fprintf(stderr, "event_test: loop A accepted again once loop B freed descriptors\n");
+      status = 0;
+    }
+  }
+
+  stop_busy = 1;
+  pthread_join(busy_thread, NULL);
+  kill(child, SIGTERM);
+  waitpid(child, NULL, 0);
+  return status;
+}
@@ -0,0 +1,187 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "cipher.h"
+#include "protocol.h"
+
+int otp_send_all(int socket, const void *buffer, size_t length) {
+  const char *p = buffer;
+  while (length > 0) {
+    ssize_t sent = send(socket, p, length, 0);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return -1;
+    }
+    p += sent;
+    length -= sent;
+  }
+  return 0;
+}
+
+int otp_recv_all(int socket, void *buffer, size_t length) {
+  char *p = buffer;
+  while (length > 0) {
+    ssize_t received = recv(socket, p, length, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return -1;
+    }
+    p += received;
+    length -= received;
+  }
+  return 0;
+}
+
+// 'A' to 'Z' are 0 to 25 and a space is 26. Anything else is -1.
+static int character_index(char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  }
+  return c == ' ' ? 26 : -1;
+}
+
+int otp_read_message(FILE *text, FILE *key, long size, char **text_out, char **key_out, size_t *length) {
+  char *t = malloc(size + 1);
+  char *k = malloc(size + 1);
+  size_t n = 0;
+
+  if (t == NULL || k == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  while (1) {
+    int tc = fgetc(text);
+    int kc = fgetc(key);
+    if (tc == EOF || kc == EOF || tc == '\n' || kc == '\n') {
+      break;
+    }
+    if (character_index(tc) < 0 || character_index(kc) < 0) {
+      free(t);
+      free(k);
+      return character_index(tc) < 0 ? 1 : 2;
+    }
+    t[n] = tc;
+    k[n] = kc;
+    n++;
+  }
+  *text_out = t;
+  *key_out = k;
+  *length = n;
+  return 0;
+}
+
+int otp_client_hello(int socket, char mode) {
+  char hello[3] = { OTP_HELLO, '0' + OTP_VERSION, mode };
+  char reply[3];
+
+  if (otp_send_all(socket, hello, sizeof(hello)) < 0 || otp_recv_all(socket, reply, sizeof(reply)) < 0) {
+    return -2;
+  }
+  if (reply[2] == WRONG_CLIENT) {
+    return -1;
+  }
+  if (reply[0] == OTP_HELLO) {
+    return reply[1] - '0';
+  }
+  // A version 1 server took the hello for a character
+  return OTP_VERSION_LEGACY;
+}
+
+/* Sends and receives at the same time, so that neither side can fill its
+ * socket buffer and block while the other is blocked sending too. */
+int otp_client_framed(int socket, const char *text, const char *key, size_t length, FILE *out) {
+  static char frame[4 + 2 * OTP_BLOCK_SIZE];
+  static char reply[OTP_BLOCK_SIZE];
+  size_t frame_length = 0, frame_sent = 0;
+  size_t queued = 0, received = 0;
+  int done = 0;   // The block of length 0 has been queued
+
+  while (received < length || frame_sent < frame_length || !done) {
+    // Queue the next block once the last one has gone
+    if (frame_sent == frame_length && !done) {
+      uint32_t n = length - queued < OTP_BLOCK_SIZE ? length - queued : OTP_BLOCK_SIZE;
+      uint32_t header = htonl(n);
+      memcpy(frame, &header, 4);
+      memcpy(frame + 4, text + queued, n);
+      memcpy(frame + 4 + n, key + queued, n);
+      frame_length = 4 + 2 * n;
+      frame_sent = 0;
+      queued += n;
+      done = n == 0;
+    }
+
+    struct pollfd pfd = { .fd = socket, .events = POLLIN };
+    if (frame_sent < frame_length) {
+      pfd.events |= POLLOUT;
+    }
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (pfd.revents & POLLOUT) {
+      ssize_t sent = send(socket, frame + frame_sent, frame_length - frame_sent, MSG_DONTWAIT);
+      if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return -1;
+      }
+      if (sent > 0) {
+        frame_sent += sent;
+      }
+    }
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = recv(socket, reply, sizeof(reply), MSG_DONTWAIT);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        return -1;
+      }
+      if (n > 0) {
+        fwrite(reply, 1, n, out);
+        received += n;
+      }
+    }
+  }
+  return 0;
+}
+
+int otp_serve_framed(int socket, char mode, const char *hello) {
+  static char block[2 * OTP_BLOCK_SIZE];
+  static char result[OTP_BLOCK_SIZE];
+  int version = hello[1] - '0';
+  char reply[3] = { OTP_HELLO, '0' + OTP_VERSION, hello[2] == mode ? mode : WRONG_CLIENT };
+
+  if (version < OTP_VERSION_FRAMED) {
+    return -1;
+  }
+  if (version > OTP_VERSION) {
+    version = OTP_VERSION;
+  }
+  reply[1] = '0' + version;
+  if (otp_send_all(socket, reply, sizeof(reply)) < 0 || reply[2] == WRONG_CLIENT) {
+    return -1;
+  }
+
+  while (1) {
+    uint32_t header;
+    if (otp_recv_all(socket, &header, 4) < 0) {
+      return -1;
+    }
+    uint32_t n = ntohl(header);
+    if (n == 0) {
+      return 0;
+    }
+    if (n > OTP_BLOCK_SIZE || otp_recv_all(socket, block, 2 * n) < 0 ||
+        cipher_apply(mode, block, block + n, result, n) < 0 || otp_send_all(socket, result, n) < 0) {
+      return -1;
+    }
+  }
+}
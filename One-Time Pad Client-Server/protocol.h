@@ -0,0 +1,61 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* The framed protocol shared by the clients and servers.
+ *
+ * The original protocol (version 1) sends {text_char, key_char, mode} for
+ * every character and waits for a 3-byte reply before sending the next. A
+ * client that speaks the framed protocol (version 2) first sends a hello,
+ * {OTP_HELLO, '0' + version, mode}, which no version 1 client can send.
+ *
+ *   - A framed server replies {OTP_HELLO, '0' + version, mode}, with the
+ *     highest version both sides speak, or with WRONG_CLIENT in place of
+ *     mode when the client is for the other server.
+ *   - A version 1 server takes the hello for a character to encrypt or
+ *     decrypt and replies {c, RESPONSE_CHARACTER, '\0'}. The client then
+ *     carries on in version 1 on the same connection.
+ *
+ * In version 2 the client sends blocks of up to OTP_BLOCK_SIZE characters,
+ * each a 4-byte length in network byte order followed by that many text
+ * characters and then as many key characters, and a block of length 0 when
+ * it is done. The server answers each block with its result, length
+ * characters with no header, while the client goes on sending. */
+
+#define OTP_HELLO '~'
+#define OTP_VERSION_LEGACY 1
+#define OTP_VERSION_FRAMED 2
+// Newest version this build speaks
+#define OTP_VERSION OTP_VERSION_FRAMED
+
+#define OTP_BLOCK_SIZE 65536
+
+#define WRONG_CLIENT 'w'
+#define RESPONSE_CHARACTER 'c'
+
+// Send or receive exactly length bytes. Return 0, or -1 on an error or if
+// the other side closed the connection first.
+int otp_send_all(int socket, const void *buffer, size_t length);
+int otp_recv_all(int socket, void *buffer, size_t length);
+
+/* Read the message and key, up to the first newline in either, checking
+ * every character. size is the longest the message can be. Returns 0 and
+ * malloc()ed copies of both, or 1 if text holds a bad character, 2 if key
+ * does. */
+int otp_read_message(FILE *text, FILE *key, long size, char **text_out, char **key_out, size_t *length);
+
+// Client: send the hello for mode and return the version the server agreed
+// to, or -1 if the server is for the other mode, -2 on a socket error.
+int otp_client_hello(int socket, char mode);
+// Client, version 2: send text and key and write the result to out.
+// Returns 0, or -1 on a socket error.
+int otp_client_framed(int socket, const char *text, const char *key, size_t length, FILE *out);
+
+// Server: answer the hello already read into hello, and serve the blocks
+// that follow if the client asked for version 2. Returns 0 once the client
+// is done, or -1 if it broke the protocol or the connection failed.
+int otp_serve_framed(int socket, char mode, const char *hello);
+
+#endif